@@ -41,7 +41,8 @@ struct metaball {
 
 static struct msurf_volume vol;
 
-static struct metaball mballs[MAX_MBALLS] = {
+/* the first few blobs have hand-picked parameters, the rest are random */
+static struct metaball def_mballs[] = {
 	{2.18038, {1.09157, 1.69766, 1}, {0.622818, 0.905624, 0}, 1.24125, 0.835223},
 	{2.03646, {0.916662, 1.2161, 1}, {0.118734, 0.283516, 0}, 2.29201, 1.0134},
 	{2.40446, {1.87429, 1.57595, 1}, {0.298566, -0.788474, 0}, 3.8137, 0.516301},
@@ -51,6 +52,13 @@ static struct metaball mballs[MAX_MBALLS] = {
 	{1.30046, {1.83729, 1.02869, 1}, {-0.476708, 0.676994, 0}, 5.77441, 0.569755},
 	{2.39865, {1.28899, 0.788321, 1}, {-0.910677, 0.359099, 0}, 5.5935, 0.848893}
 };
+#define NUM_DEF_MBALLS	(sizeof def_mballs / sizeof *def_mballs)
+
+static struct metaball *mballs;
+static int max_mballs;
+
+/* isosurface value to use with each falloff kernel */
+static const float falloff_iso[MFIELD_NUM_KERNELS] = {8.0f, 0.5f, 0.5f, 0.5f};
 
 static int win_width, win_height;
 static unsigned char *stencil;
@@ -66,9 +74,12 @@ static float mtl_ks[] = {0.6, 0.6, 0.6, 1};
 
 int use_shape = 1;
 int use_envmap = 1;
-int num_mballs = MAX_MBALLS;
+int num_mballs = DEF_MBALLS;
+int num_threads = 1;
 char *tex_fname;
 
+static int alloc_mballs(int count);
+static void rand_mball(struct metaball *mb);
 static void draw_mesh(struct msurf_vertex *varr, unsigned int vcount);
 
 
@@ -132,38 +143,23 @@ int init()
 	if(msurf_init(&vol) == -1) {
 		return -1;
 	}
-	if(msurf_metaballs(&vol, MAX_MBALLS) == -1) {
-		msurf_destroy(&vol);
-		return -1;
-	}
-	vol.isoval = 8;
+	vol.falloff = MFIELD_INVSQ;
+	vol.falloff_rad = 0.75;
+	vol.isoval = falloff_iso[vol.falloff];
+	vol.cutoff = 0.05;
+	vol.num_threads = num_threads;
 	msurf_resolution(&vol, 40, 40, 40);
 	msurf_size(&vol, 7, 7, 7);
+	vol.flags |= MSURF_AUTOFIT;		/* only the part of the cube the blobs reach */
 
 #ifdef RANDOM_BLOB_PARAMS
-	{
-		int j;
-		srand(time(0));
-		for(i=0; i<MAX_MBALLS; i++) {
-			mballs[i].energy = frand() * 2.0 + 0.5;
-			for(j=0; j<2; j++) {
-				mballs[i].path_scale[j] = frand() * 1.5 + 0.5;
-				mballs[i].path_offset[j] = (frand() * 2.0 - 1.0) * 1.1;
-			}
-			mballs[i].path_scale[2] = 1;
-			mballs[i].path_offset[2] = 0;
-			mballs[i].phase_offset = frand() * M_PI * 2.0;
-			mballs[i].speed = frand() + 0.5;
-		}
-	}
+	srand(time(0));
 #endif
-
-	for(i=0; i<MAX_MBALLS; i++) {
-		vol.mballs[i].energy = mballs[i].energy;
+	if(alloc_mballs(num_mballs) == -1) {
+		msurf_destroy(&vol);
+		return -1;
 	}
 
-	vol.num_mballs = num_mballs;
-
 	start_time = get_time_msec();
 	return 0;
 }
@@ -171,11 +167,61 @@ int init()
 void cleanup()
 {
 	msurf_destroy(&vol);
+	free(mballs);
 }
 
-static void update(double sec)
+/* makes sure we have at least count blobs, and sets vol.num_mballs */
+static int alloc_mballs(int count)
 {
 	int i;
+	struct metaball *tmp;
+
+	if(count > max_mballs) {
+		if(!(tmp = realloc(mballs, count * sizeof *mballs))) {
+			fprintf(stderr, "failed to allocate %d blobs\n", count);
+			return -1;
+		}
+		mballs = tmp;
+
+		if(msurf_metaballs(&vol, count) == -1) {
+			return -1;
+		}
+
+		for(i=max_mballs; i<count; i++) {
+#ifndef RANDOM_BLOB_PARAMS
+			if(i < (int)NUM_DEF_MBALLS) {
+				mballs[i] = def_mballs[i];
+			} else
+#endif
+			{
+				rand_mball(mballs + i);
+			}
+			vol.mballs[i].energy = mballs[i].energy;
+		}
+		max_mballs = count;
+	}
+	vol.num_mballs = count;
+	return 0;
+}
+
+static void rand_mball(struct metaball *mb)
+{
+	int i;
+
+	mb->energy = frand() * 2.0 + 0.5;
+	for(i=0; i<2; i++) {
+		mb->path_scale[i] = frand() * 1.5 + 0.5;
+		mb->path_offset[i] = (frand() * 2.0 - 1.0) * 1.1;
+	}
+	mb->path_scale[2] = 1;
+	mb->path_offset[2] = 0;
+	mb->phase_offset = frand() * M_PI * 2.0;
+	mb->speed = frand() + 0.5;
+}
+
+static void update(double sec)
+{
+	unsigned int i;
 
 	for(i=0; i<vol.num_mballs; i++) {
 		float t = sec * mballs[i].speed + mballs[i].phase_offset;
@@ -289,9 +335,13 @@ void keyboard(int key, int pressed)
 			break;
 
 		case '=':
-			if(vol.num_mballs < MAX_MBALLS) {
-				vol.num_mballs++;
-			}
+			alloc_mballs(vol.num_mballs + 1);
+			break;
+
+		case 'f':
+		case 'F':
+			vol.falloff = (vol.falloff + 1) % MFIELD_NUM_KERNELS;
+			vol.isoval = falloff_iso[vol.falloff];
 			break;
 
 		case 't':
@@ -18,11 +18,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef BLOBS_H_
 #define BLOBS_H_
 
-#define MAX_MBALLS	8
+#define DEF_MBALLS	8
 
 extern char *tex_fname;	/* optional texture filename */
 extern int use_shape, use_envmap;
 extern int num_mballs;
+extern int num_threads;	/* mesh generation threads */
 
 int init();
 void cleanup();
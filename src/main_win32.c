@@ -44,6 +44,10 @@ int WINAPI WinMain(HINSTANCE hinst, HINSTANCE prev_hinst, char *cmdline, int sho
 {
 	int argc;
 	char **argv = chop_args(cmdline, &argc);
+	SYSTEM_INFO sysinf;
+
+	GetSystemInfo(&sysinf);
+	num_threads = sysinf.dwNumberOfProcessors;
 	if(parse_args(argc, argv) == -1) {
 		return 1;
 	}
@@ -323,10 +327,17 @@ static int parse_args(int argc, char **argv)
 					win_x = win_y = -1;
 				}
 
+			} else if(strcmp(argv[i], "-threads") == 0) {
+				if(!argv[++i] || (num_threads = atoi(argv[i])) < 1) {
+					fprintf(stderr, "invalid -threads option, expected a positive number\n");
+					return -1;
+				}
+
 			} else if(strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "-h") == 0) {
 				printf("Usage: %s [options]\n", argv[0]);
 				printf("options:\n");
 				printf(" -geometry [WxH][+X+Y]  set window size and/or position\n");
+				printf(" -threads <n>           set number of mesh generation threads\n");
 				printf(" -help                  print usage and exit\n");
 				return 0;
 			} else {
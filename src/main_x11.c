@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <GL/gl.h>
@@ -50,6 +51,9 @@ int main(int argc, char **argv)
 {
 	XEvent ev;
 
+	if((num_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		num_threads = 1;
+	}
 	if(parse_args(argc, argv) == -1) {
 		return 1;
 	}
@@ -384,8 +388,14 @@ static int parse_args(int argc, char **argv)
 				}
 
 			} else if(strcmp(argv[i], "-blobs") == 0) {
-				if(!argv[++i] || (num_mballs = atoi(argv[i])) < 1 || num_mballs > MAX_MBALLS) {
-					fprintf(stderr, "invalid -blobs option, expected number between 1 and %d\n", MAX_MBALLS);
+				if(!argv[++i] || (num_mballs = atoi(argv[i])) < 1) {
+					fprintf(stderr, "invalid -blobs option, expected a positive number\n");
+					return -1;
+				}
+
+			} else if(strcmp(argv[i], "-threads") == 0) {
+				if(!argv[++i] || (num_threads = atoi(argv[i])) < 1) {
+					fprintf(stderr, "invalid -threads option, expected a positive number\n");
 					return -1;
 				}
 
@@ -399,7 +409,9 @@ static int parse_args(int argc, char **argv)
 				printf("Usage: %s [options]\n", argv[0]);
 				printf("options:\n");
 				printf(" -geometry [WxH][+X+Y]  set window size and/or position\n");
-				printf(" -blobs <n>             set number of blobs (1 to %d)\n", MAX_MBALLS);
+				printf(" -blobs <n>             set number of blobs (default: %d)\n", DEF_MBALLS);
+				printf(" -threads <n>           set number of mesh generation threads (default: %d)\n",
+						num_threads);
 				printf(" -notex                 disable environment map\n");
 				printf(" -noshape				start with regular unshaped window\n");
 				printf(" -help                  print usage and exit\n");
@@ -407,6 +419,7 @@ static int parse_args(int argc, char **argv)
 				printf("\nhotkeys:\n");
 				printf(" S: toggle shaped window\n");
 				printf(" T: toggle environment map\n");
+				printf(" F: cycle field falloff function\n");
 				printf(" -/+: change number of blobs\n");
 				printf(" Q: quit\n");
 				exit(0);
@@ -0,0 +1,732 @@
+/*
+shapeblobs - 3D metaballs in a shaped window
+Copyright (C) 2016-2026  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mfield.h"
+
+#define INLINE	__inline
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define USE_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON
+#endif
+
+/* field value used at the exact center of an INVSQ metaball */
+#define CENTER_VAL	1024.0f
+
+/* Blinn kernel sharpness: 4 ln 2 gives half the peak value at half the radius,
+ * like the Wyvill kernel
+ */
+#define BLINN_B		2.7725887f
+/* Blinn kernel cutoff value, if none is specified */
+#define BLINN_DEF_CUTOFF	1e-3f
+
+/* upper limit of spatial index cells along each axis */
+#define MAX_GRID_RES	64
+
+/* a list of balls to evaluate, either all of them or a spatial index cell */
+struct bset {
+	const float *x, *y, *z, *energy, *irad;
+	const int *idx;		/* ball indices into the axis tables, 0: identity */
+	int num;
+};
+
+typedef void (*kern_func)(const struct bset*, const float*, const float*,
+		const float*, float*, float);
+typedef void (*sep_func)(const struct bset*, const struct mfield*, int, int,
+		int, float*, float);
+typedef void (*gkern_func)(const struct bset*, const float*, const float*,
+		const float*, float*, float*, float*, float*, float);
+typedef void (*sepg_func)(const struct bset*, const struct mfield*, int, int,
+		int, const float*, float, float, float*, float*, float*, float*, float);
+
+/* axis table rows are padded to this many entries, to allow reading a full
+ * batch of lanes past the end of a row
+ */
+#define TAB_PAD		8
+
+/* scalar instantiation of the falloff kernels */
+#define LANES_SCALAR	1
+typedef float vfloat;
+typedef int vmask;
+#define vset1(x)		(x)
+#define vload(p)		(*(p))
+#define vstore(p, v)	(*(p) = (v))
+#define vadd(a, b)		((a) + (b))
+#define vsub(a, b)		((a) - (b))
+#define vmul(a, b)		((a) * (b))
+#define vdiv(a, b)		((a) / (b))
+#define vsqrt(a)		((float)sqrt(a))
+#define vlt(a, b)		((a) < (b))
+#define veq(a, b)		((a) == (b))
+#define vsel(m, a, b)	((m) ? (a) : (b))
+#define vand(m, a)		((m) ? (a) : 0.0f)
+#define vany(m)			(m)
+#define KFUNC(x)		scalar_##x
+#include "mfkern.inl"
+#undef vfloat
+#undef vmask
+#undef vset1
+#undef vload
+#undef vstore
+#undef vadd
+#undef vsub
+#undef vmul
+#undef vdiv
+#undef vsqrt
+#undef vlt
+#undef veq
+#undef vsel
+#undef vand
+#undef vany
+#undef KFUNC
+
+/* SIMD instantiation. vsel(m, a, b) is m ? a : b, vand(m, a) is m ? a : 0 */
+#ifdef USE_AVX
+#define LANES	8
+#define vfloat			__m256
+#define vmask			__m256
+#define vset1(x)		_mm256_set1_ps(x)
+#define vload(p)		_mm256_loadu_ps(p)
+#define vstore(p, v)	_mm256_storeu_ps(p, v)
+#define vadd(a, b)		_mm256_add_ps(a, b)
+#define vsub(a, b)		_mm256_sub_ps(a, b)
+#define vmul(a, b)		_mm256_mul_ps(a, b)
+#define vdiv(a, b)		_mm256_div_ps(a, b)
+#define vsqrt(a)		_mm256_sqrt_ps(a)
+#define vlt(a, b)		_mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define veq(a, b)		_mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define vsel(m, a, b)	_mm256_blendv_ps(b, a, m)
+#define vand(m, a)		_mm256_and_ps(m, a)
+#define vany(m)			_mm256_movemask_ps(m)
+
+#elif defined(USE_SSE2)
+#define LANES	4
+#define vfloat			__m128
+#define vmask			__m128
+#define vset1(x)		_mm_set1_ps(x)
+#define vload(p)		_mm_loadu_ps(p)
+#define vstore(p, v)	_mm_storeu_ps(p, v)
+#define vadd(a, b)		_mm_add_ps(a, b)
+#define vsub(a, b)		_mm_sub_ps(a, b)
+#define vmul(a, b)		_mm_mul_ps(a, b)
+#define vdiv(a, b)		_mm_div_ps(a, b)
+#define vsqrt(a)		_mm_sqrt_ps(a)
+#define vlt(a, b)		_mm_cmplt_ps(a, b)
+#define veq(a, b)		_mm_cmpeq_ps(a, b)
+#define vsel(m, a, b)	sse_select(m, a, b)
+#define vand(m, a)		_mm_and_ps(m, a)
+#define vany(m)			_mm_movemask_ps(m)
+
+static INLINE __m128 sse_select(__m128 m, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+
+#elif defined(USE_NEON)
+#define LANES	4
+#define vfloat			float32x4_t
+#define vmask			uint32x4_t
+#define vset1(x)		vdupq_n_f32(x)
+#define vload(p)		vld1q_f32(p)
+#define vstore(p, v)	vst1q_f32(p, v)
+#define vadd(a, b)		vaddq_f32(a, b)
+#define vsub(a, b)		vsubq_f32(a, b)
+#define vmul(a, b)		vmulq_f32(a, b)
+#define vlt(a, b)		vcltq_f32(a, b)
+#define veq(a, b)		vceqq_f32(a, b)
+#define vsel(m, a, b)	vbslq_f32(m, a, b)
+#define vand(m, a)		vreinterpretq_f32_u32(vandq_u32(m, vreinterpretq_u32_f32(a)))
+#ifdef __aarch64__
+#define vdiv(a, b)		vdivq_f32(a, b)
+#define vsqrt(a)		vsqrtq_f32(a)
+#define vany(m)			vmaxvq_u32(m)
+#else
+#define vdiv(a, b)		neon_div(a, b)
+#define vsqrt(a)		neon_sqrt(a)
+#define vany(m)			neon_any(m)
+
+/* no vector divide or sqrt on armv7, refine the estimates twice */
+static INLINE float32x4_t neon_div(float32x4_t a, float32x4_t b)
+{
+	float32x4_t rcp = vrecpeq_f32(b);
+	rcp = vmulq_f32(rcp, vrecpsq_f32(b, rcp));
+	rcp = vmulq_f32(rcp, vrecpsq_f32(b, rcp));
+	return vmulq_f32(a, rcp);
+}
+
+static INLINE float32x4_t neon_sqrt(float32x4_t a)
+{
+	float32x4_t rs = vrsqrteq_f32(a);
+	rs = vmulq_f32(rs, vrsqrtsq_f32(vmulq_f32(a, rs), rs));
+	rs = vmulq_f32(rs, vrsqrtsq_f32(vmulq_f32(a, rs), rs));
+	return vmulq_f32(a, rs);
+}
+
+static INLINE int neon_any(uint32x4_t m)
+{
+	uint32x2_t t = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+	return vget_lane_u32(vpmax_u32(t, t), 0);
+}
+#endif	/* !__aarch64__ */
+#endif	/* USE_NEON */
+
+#ifdef LANES
+#define KFUNC(x)		simd_##x
+#include "mfkern.inl"
+#else
+#define LANES	LANES_SCALAR
+#define simd_kernels	scalar_kernels
+#define simd_sep_kernels	scalar_sep_kernels
+#define simd_gkernels	scalar_gkernels
+#define simd_sep_gkernels	scalar_sep_gkernels
+#endif
+
+
+static void eval_points(struct mfield *mf, const struct bset *bs,
+		const float *px, const float *py, const float *pz, float *res,
+		float *grad, int n);
+
+
+int mfield_init(struct mfield *mf)
+{
+	memset(mf, 0, sizeof *mf);
+	return 0;
+}
+
+void mfield_destroy(struct mfield *mf)
+{
+	free(mf->x);
+	free(mf->gstart);
+	free(mf->gx);
+	free(mf->gidx);
+	free(mf->tabx);
+	memset(mf, 0, sizeof *mf);
+}
+
+int mfield_resize(struct mfield *mf, int num)
+{
+	float *buf;
+
+	if(num > mf->max) {
+		/* all arrays share a single allocation */
+		if(!(buf = malloc(num * 5 * sizeof *buf))) {
+			fprintf(stderr, "mfield: failed to allocate %d metaballs\n", num);
+			return -1;
+		}
+		free(mf->x);
+		mf->x = buf;
+		mf->y = buf + num;
+		mf->z = buf + num * 2;
+		mf->energy = buf + num * 3;
+		mf->irad = buf + num * 4;
+		mf->max = num;
+	}
+	mf->num = num;
+	return 0;
+}
+
+void mfield_kernel(struct mfield *mf, int kernel, float rad, float cutoff)
+{
+	int i;
+
+	mf->kernel = kernel;
+	mf->kparam = 0.0f;
+
+	switch(kernel) {
+	case MFIELD_INVSQ:
+		/* support radius where energy / r^2 == cutoff */
+		for(i=0; i<mf->num; i++) {
+			mf->irad[i] = cutoff > 0.0f ? cutoff / mf->energy[i] : 0.0f;
+		}
+		break;
+
+	case MFIELD_WYVILL:
+	case MFIELD_NISHIMURA:
+		for(i=0; i<mf->num; i++) {
+			mf->irad[i] = 1.0f / (rad * rad * mf->energy[i]);
+		}
+		break;
+
+	case MFIELD_BLINN:
+		/* exp(-B r^2 / R^2) == cutoff at r^2 == R^2 ln(1/cutoff) / B */
+		if(cutoff <= 0.0f) cutoff = BLINN_DEF_CUTOFF;
+		mf->kparam = log(1.0f / cutoff);
+		for(i=0; i<mf->num; i++) {
+			mf->irad[i] = BLINN_B / (rad * rad * mf->energy[i] * mf->kparam);
+		}
+		break;
+
+	default:
+		fprintf(stderr, "mfield: invalid kernel: %d\n", kernel);
+		abort();
+	}
+}
+
+static INLINE int grid_coord(struct mfield *mf, float x, int axis)
+{
+	int c = (int)((x - mf->gorg[axis]) * mf->ginvsz);
+	return c < 0 ? 0 : (c >= mf->gres[axis] ? mf->gres[axis] - 1 : c);
+}
+
+/* calculates the range of grid cells touched by ball i, returns 0 if it
+ * doesn't reach the grid at all
+ */
+static int ball_cells(struct mfield *mf, int i, float rad, int *cmin, int *cmax)
+{
+	int j;
+	float lo, hi, pos[3];
+
+	pos[0] = mf->x[i];
+	pos[1] = mf->y[i];
+	pos[2] = mf->z[i];
+	for(j=0; j<3; j++) {
+		lo = pos[j] - rad - mf->gorg[j];
+		hi = pos[j] + rad - mf->gorg[j];
+		if(hi < 0.0f || lo > mf->gres[j] * mf->gcellsz) {
+			return 0;
+		}
+		cmin[j] = grid_coord(mf, pos[j] - rad, j);
+		cmax[j] = grid_coord(mf, pos[j] + rad, j);
+	}
+	return 1;
+}
+
+int mfield_build_grid(struct mfield *mf, const float *bmin, const float *bmax,
+		float margin)
+{
+	int i, j, x, y, z, idx, count, cmin[3], cmax[3];
+	float rad, maxrad, ext, maxext, minirad;
+	void *tmp;
+
+	mf->num_gcells = 0;
+	if(mf->num <= 0) {
+		return 0;
+	}
+
+	minirad = mf->irad[0];
+	for(i=1; i<mf->num; i++) {
+		if(mf->irad[i] < minirad) minirad = mf->irad[i];
+	}
+	if(minirad <= 0.0f) {
+		return 0;	/* at least one ball reaches everywhere */
+	}
+	maxrad = 1.0f / sqrt(minirad);
+
+	/* cells as large as the largest support radius, but not too many */
+	maxext = 0.0f;
+	for(i=0; i<3; i++) {
+		ext = bmax[i] - bmin[i];
+		if(ext > maxext) maxext = ext;
+	}
+	mf->gcellsz = maxrad;
+	if(mf->gcellsz < maxext / MAX_GRID_RES) {
+		mf->gcellsz = maxext / MAX_GRID_RES;
+	}
+	if(mf->gcellsz <= 0.0f) {
+		return 0;
+	}
+	mf->ginvsz = 1.0f / mf->gcellsz;
+	count = 1;
+	for(i=0; i<3; i++) {
+		mf->gorg[i] = bmin[i];
+		mf->gres[i] = (int)ceil((bmax[i] - bmin[i]) * mf->ginvsz);
+		if(mf->gres[i] < 1) mf->gres[i] = 1;
+		count *= mf->gres[i];
+	}
+
+	if(count + 1 > mf->max_gcells) {
+		if(!(tmp = realloc(mf->gstart, (count + 1) * sizeof *mf->gstart))) {
+			fprintf(stderr, "mfield: failed to allocate spatial index\n");
+			return -1;
+		}
+		mf->gstart = tmp;
+		mf->max_gcells = count + 1;
+	}
+	memset(mf->gstart, 0, (count + 1) * sizeof *mf->gstart);
+
+	/* first pass: count balls per cell */
+	for(i=0; i<mf->num; i++) {
+		rad = 1.0f / sqrt(mf->irad[i]) + margin;
+		if(!ball_cells(mf, i, rad, cmin, cmax)) continue;
+		for(z=cmin[2]; z<=cmax[2]; z++) {
+			for(y=cmin[1]; y<=cmax[1]; y++) {
+				for(x=cmin[0]; x<=cmax[0]; x++) {
+					mf->gstart[(z * mf->gres[1] + y) * mf->gres[0] + x + 1]++;
+				}
+			}
+		}
+	}
+	for(i=0; i<count; i++) {
+		mf->gstart[i + 1] += mf->gstart[i];
+	}
+
+	if(mf->gstart[count] > mf->max_gref) {
+		int newsz = mf->gstart[count];
+		if(!(tmp = malloc(newsz * 5 * sizeof *mf->gx))) {
+			fprintf(stderr, "mfield: failed to allocate spatial index\n");
+			return -1;
+		}
+		free(mf->gidx);
+		if(!(mf->gidx = malloc(newsz * sizeof *mf->gidx))) {
+			fprintf(stderr, "mfield: failed to allocate spatial index\n");
+			free(tmp);
+			return -1;
+		}
+		free(mf->gx);
+		mf->gx = tmp;
+		mf->gy = mf->gx + newsz;
+		mf->gz = mf->gx + newsz * 2;
+		mf->genergy = mf->gx + newsz * 3;
+		mf->girad = mf->gx + newsz * 4;
+		mf->max_gref = newsz;
+	}
+
+	/* second pass: fill in the per-cell ball lists, in ball order, using
+	 * gstart as insertion cursors, then shift it back
+	 */
+	for(i=0; i<mf->num; i++) {
+		rad = 1.0f / sqrt(mf->irad[i]) + margin;
+		if(!ball_cells(mf, i, rad, cmin, cmax)) continue;
+		for(z=cmin[2]; z<=cmax[2]; z++) {
+			for(y=cmin[1]; y<=cmax[1]; y++) {
+				for(x=cmin[0]; x<=cmax[0]; x++) {
+					idx = (z * mf->gres[1] + y) * mf->gres[0] + x;
+					j = mf->gstart[idx]++;
+					mf->gx[j] = mf->x[i];
+					mf->gy[j] = mf->y[i];
+					mf->gz[j] = mf->z[i];
+					mf->genergy[j] = mf->energy[i];
+					mf->girad[j] = mf->irad[i];
+					mf->gidx[j] = i;
+				}
+			}
+		}
+	}
+	for(i=count; i>0; i--) {
+		mf->gstart[i] = mf->gstart[i - 1];
+	}
+	mf->gstart[0] = 0;
+
+	mf->num_gcells = count;
+	return 0;
+}
+
+static INLINE void all_balls(struct mfield *mf, struct bset *bs)
+{
+	bs->x = mf->x;
+	bs->y = mf->y;
+	bs->z = mf->z;
+	bs->energy = mf->energy;
+	bs->irad = mf->irad;
+	bs->idx = 0;
+	bs->num = mf->num;
+}
+
+/* finds the balls near (x, y, z), or all balls if there's no spatial index */
+static INLINE void near_balls(struct mfield *mf, float x, float y, float z,
+		struct bset *bs)
+{
+	int idx, start;
+
+	if(!mf->num_gcells) {
+		all_balls(mf, bs);
+		return;
+	}
+
+	idx = (grid_coord(mf, z, 2) * mf->gres[1] + grid_coord(mf, y, 1)) *
+		mf->gres[0] + grid_coord(mf, x, 0);
+	start = mf->gstart[idx];
+	bs->x = mf->gx + start;
+	bs->y = mf->gy + start;
+	bs->z = mf->gz + start;
+	bs->energy = mf->genergy + start;
+	bs->irad = mf->girad + start;
+	bs->idx = mf->gidx + start;
+	bs->num = mf->gstart[idx + 1] - start;
+}
+
+void mfield_eval(struct mfield *mf, const float *px, const float *py,
+		const float *pz, float *res, float *grad, int n)
+{
+	struct bset bs;
+	all_balls(mf, &bs);
+	eval_points(mf, &bs, px, py, pz, res, grad, n);
+}
+
+void mfield_eval_ball(struct mfield *mf, int ball, const float *px,
+		const float *py, const float *pz, float *res, float *grad, int n)
+{
+	struct bset bs;
+
+	bs.x = mf->x + ball;
+	bs.y = mf->y + ball;
+	bs.z = mf->z + ball;
+	bs.energy = mf->energy + ball;
+	bs.irad = mf->irad + ball;
+	bs.idx = 0;
+	bs.num = 1;
+	eval_points(mf, &bs, px, py, pz, res, grad, n);
+}
+
+float mfield_falloff(struct mfield *mf, int ball, float lensq)
+{
+	float q = lensq * mf->irad[ball];
+	float energy = mf->energy[ball];
+
+	if(q >= 1.0f) return 0.0f;
+
+	switch(mf->kernel) {
+	case MFIELD_INVSQ:
+		return scalar_f_invsq(lensq, q, energy, mf->kparam);
+	case MFIELD_WYVILL:
+		return scalar_f_wyvill(lensq, q, energy, mf->kparam);
+	case MFIELD_NISHIMURA:
+		return scalar_f_nishimura(lensq, q, energy, mf->kparam);
+	case MFIELD_BLINN:
+		return scalar_f_blinn(lensq, q, energy, mf->kparam);
+	default:
+		break;
+	}
+	return 0.0f;
+}
+
+void mfield_eval_scalar(struct mfield *mf, const float *px, const float *py,
+		const float *pz, float *res, float *grad, int n)
+{
+	int i;
+	struct bset bs;
+	kern_func kern = scalar_kernels[mf->kernel];
+	gkern_func gkern = scalar_gkernels[mf->kernel];
+
+	all_balls(mf, &bs);
+	for(i=0; i<n; i++) {
+		if(grad) {
+			gkern(&bs, px + i, py + i, pz + i, res + i, grad + i, grad + n + i,
+					grad + 2 * n + i, mf->kparam);
+		} else {
+			kern(&bs, px + i, py + i, pz + i, res + i, mf->kparam);
+		}
+	}
+}
+
+void mfield_eval_near(struct mfield *mf, float x, float y, float z,
+		const float *px, const float *py, const float *pz, float *res,
+		float *grad, int n)
+{
+	struct bset bs;
+	near_balls(mf, x, y, z, &bs);
+	eval_points(mf, &bs, px, py, pz, res, grad, n);
+}
+
+int mfield_axis_tables(struct mfield *mf, const float *org, const float *step,
+		const int *res)
+{
+	int i, j, b, stride[3], total;
+	float d, *tab[3], *bpos[3];
+	float *buf;
+
+	stride[0] = (res[0] + TAB_PAD - 1) & ~(TAB_PAD - 1);
+	stride[1] = res[1];
+	stride[2] = res[2];
+	total = (stride[0] + stride[1] + stride[2]) * mf->num;
+
+	if(total > mf->max_tab) {
+		if(!(buf = malloc(total * sizeof *buf))) {
+			fprintf(stderr, "mfield: failed to allocate axis tables\n");
+			return -1;
+		}
+		free(mf->tabx);
+		mf->tabx = buf;
+		mf->max_tab = total;
+	}
+	mf->taby = mf->tabx + stride[0] * mf->num;
+	mf->tabz = mf->taby + stride[1] * mf->num;
+
+	tab[0] = mf->tabx;
+	tab[1] = mf->taby;
+	tab[2] = mf->tabz;
+	bpos[0] = mf->x;
+	bpos[1] = mf->y;
+	bpos[2] = mf->z;
+	for(i=0; i<3; i++) {
+		mf->tabres[i] = res[i];
+		mf->tabstride[i] = stride[i];
+		mf->taborg[i] = org[i];
+		mf->tabstep[i] = step[i];
+
+		for(b=0; b<mf->num; b++) {
+			float *row = tab[i] + b * stride[i];
+			for(j=0; j<stride[i]; j++) {
+				d = org[i] + (float)j * step[i] - bpos[i][b];
+				row[j] = d * d;
+			}
+		}
+	}
+	return 0;
+}
+
+/* evaluates one batch of LANES voxels of a row, with or without gradients */
+static INLINE void eval_row_lanes(struct mfield *mf, const struct bset *bs,
+		sep_func kern, sepg_func gkern, int x0, int y, int z, float *res,
+		float *gx, float *gy, float *gz)
+{
+	int i;
+	float px[LANES];
+
+	if(gkern) {
+		for(i=0; i<LANES; i++) {
+			px[i] = mf->taborg[0] + (float)(x0 + i) * mf->tabstep[0];
+		}
+		gkern(bs, mf, x0, y, z, px, mf->taborg[1] + (float)y * mf->tabstep[1],
+				mf->taborg[2] + (float)z * mf->tabstep[2], res, gx, gy, gz, mf->kparam);
+	} else {
+		kern(bs, mf, x0, y, z, res, mf->kparam);
+	}
+}
+
+void mfield_eval_row(struct mfield *mf, float cx, float cy, float cz,
+		int x0, int y, int z, float *res, float *grad, int n)
+{
+	int i, j;
+	float tres[LANES], tgrad[LANES * 3];
+	float *gx = 0, *gy = 0, *gz = 0;
+	struct bset bs;
+	sep_func kern = simd_sep_kernels[mf->kernel];
+	sepg_func gkern = grad ? simd_sep_gkernels[mf->kernel] : 0;
+
+	near_balls(mf, cx, cy, cz, &bs);
+
+	if(grad) {
+		gx = grad;
+		gy = grad + n;
+		gz = grad + 2 * n;
+	}
+
+	for(i=0; i<=n-LANES; i+=LANES) {
+		eval_row_lanes(mf, &bs, kern, gkern, x0 + i, y, z, res + i,
+				gx + i, gy + i, gz + i);
+	}
+
+	if(i < n) {
+		/* table rows are padded, so just read past the end and drop the rest */
+		for(j=0; j<LANES; j++) {
+			tres[j] = j < n - i ? res[i + j] : 0.0f;
+			if(grad) {
+				tgrad[j] = j < n - i ? gx[i + j] : 0.0f;
+				tgrad[LANES + j] = j < n - i ? gy[i + j] : 0.0f;
+				tgrad[LANES * 2 + j] = j < n - i ? gz[i + j] : 0.0f;
+			}
+		}
+		eval_row_lanes(mf, &bs, kern, gkern, x0 + i, y, z, tres, tgrad,
+				tgrad + LANES, tgrad + LANES * 2);
+		for(j=0; j<n-i; j++) {
+			res[i + j] = tres[j];
+			if(grad) {
+				gx[i + j] = tgrad[j];
+				gy[i + j] = tgrad[LANES + j];
+				gz[i + j] = tgrad[LANES * 2 + j];
+			}
+		}
+	}
+}
+
+void mfield_eval_row_scalar(struct mfield *mf, float cx, float cy, float cz,
+		int x0, int y, int z, float *res, float *grad, int n)
+{
+	int i;
+	float px;
+	struct bset bs;
+	sep_func kern = scalar_sep_kernels[mf->kernel];
+	sepg_func gkern = scalar_sep_gkernels[mf->kernel];
+
+	near_balls(mf, cx, cy, cz, &bs);
+	for(i=0; i<n; i++) {
+		if(grad) {
+			px = mf->taborg[0] + (float)(x0 + i) * mf->tabstep[0];
+			gkern(&bs, mf, x0 + i, y, z, &px, mf->taborg[1] + (float)y * mf->tabstep[1],
+					mf->taborg[2] + (float)z * mf->tabstep[2], res + i, grad + i,
+					grad + n + i, grad + 2 * n + i, mf->kparam);
+		} else {
+			kern(&bs, mf, x0 + i, y, z, res + i, mf->kparam);
+		}
+	}
+}
+
+/* evaluates n points in batches of LANES, with the kernel selected once */
+static void eval_points(struct mfield *mf, const struct bset *bs,
+		const float *px, const float *py, const float *pz, float *res,
+		float *grad, int n)
+{
+	int i, j, k;
+	float tx[LANES], ty[LANES], tz[LANES], tres[LANES], tgrad[LANES * 3];
+	float *gx, *gy, *gz;
+	kern_func kern = simd_kernels[mf->kernel];
+	gkern_func gkern = simd_gkernels[mf->kernel];
+
+	if(grad) {
+		gx = grad;
+		gy = grad + n;
+		gz = grad + 2 * n;
+		for(i=0; i<=n-LANES; i+=LANES) {
+			gkern(bs, px + i, py + i, pz + i, res + i, gx + i, gy + i, gz + i, mf->kparam);
+		}
+	} else {
+		gx = gy = gz = 0;
+		for(i=0; i<=n-LANES; i+=LANES) {
+			kern(bs, px + i, py + i, pz + i, res + i, mf->kparam);
+		}
+	}
+
+	if(i < n) {
+		/* pad the last partial batch by repeating its last point */
+		for(j=0; j<LANES; j++) {
+			k = i + j < n ? i + j : n - 1;
+			tx[j] = px[k];
+			ty[j] = py[k];
+			tz[j] = pz[k];
+			tres[j] = res[k];
+			if(grad) {
+				tgrad[j] = gx[k];
+				tgrad[LANES + j] = gy[k];
+				tgrad[LANES * 2 + j] = gz[k];
+			}
+		}
+		if(grad) {
+			gkern(bs, tx, ty, tz, tres, tgrad, tgrad + LANES, tgrad + LANES * 2, mf->kparam);
+		} else {
+			kern(bs, tx, ty, tz, tres, mf->kparam);
+		}
+		for(j=0; j<n-i; j++) {
+			res[i + j] = tres[j];
+			if(grad) {
+				gx[i + j] = tgrad[j];
+				gy[i + j] = tgrad[LANES + j];
+				gz[i + j] = tgrad[LANES * 2 + j];
+			}
+		}
+	}
+}
@@ -0,0 +1,127 @@
+/*
+shapeblobs - 3D metaballs in a shaped window
+Copyright (C) 2016-2026  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MFIELD_H_
+#define MFIELD_H_
+
+/* falloff kernels. All except INVSQ have a peak value of 1 at the center and
+ * a radius of rad * sqrt(energy), where rad is passed to mfield_kernel.
+ */
+enum {
+	MFIELD_INVSQ,		/* energy / r^2, infinite support */
+	MFIELD_WYVILL,		/* Wyvill "soft objects" polynomial, compact */
+	MFIELD_NISHIMURA,	/* Nishimura piecewise quadratic, compact */
+	MFIELD_BLINN,		/* Blinn exponential, truncated at the cutoff value */
+
+	MFIELD_NUM_KERNELS
+};
+
+/* metaball data in structure-of-arrays form, for the field evaluators.
+ * irad is 1 / (support radius)^2 of each ball, 0 for infinite support.
+ */
+struct mfield {
+	float *x, *y, *z, *energy, *irad;
+	int num, max;
+
+	int kernel;
+	float kparam;					/* kernel-specific constant */
+
+	/* uniform grid spatial index, built by mfield_build_grid. Each grid cell
+	 * holds a compact SoA copy of the balls which can reach it, laid out
+	 * contiguously: cell i owns entries [gstart[i], gstart[i + 1]).
+	 */
+	int gres[3], num_gcells;		/* num_gcells == 0: no index, use all balls */
+	float gorg[3], gcellsz, ginvsz;
+	int *gstart;
+	float *gx, *gy, *gz, *genergy, *girad;
+	int *gidx;						/* original ball index of each entry */
+	int max_gcells, max_gref;
+
+	/* per-ball squared distance tables along each axis, for separable row
+	 * evaluation: tabx[ball * tabstride[0] + x] is (voxel x - ball x)^2 etc.
+	 */
+	float *tabx, *taby, *tabz;
+	int tabres[3], tabstride[3], max_tab;
+	float taborg[3], tabstep[3];
+};
+
+int mfield_init(struct mfield *mf);
+void mfield_destroy(struct mfield *mf);
+int mfield_resize(struct mfield *mf, int num);
+
+/* selects the falloff kernel and calculates the support radius of each ball.
+ * Must be called after filling in the ball positions and energies. Balls
+ * contributing less than cutoff are ignored beyond that point (0: never,
+ * for INVSQ and BLINN).
+ */
+void mfield_kernel(struct mfield *mf, int kernel, float rad, float cutoff);
+
+/* adds the field of all metaballs at n points (px, py, pz) into res.
+ * If grad is not null, the negated field gradient is also added into it, as
+ * 3 arrays of n floats: x components, followed by y, followed by z.
+ * mfield_eval uses the widest SIMD path available (AVX, SSE2, NEON),
+ * mfield_eval_scalar is the plain C reference implementation.
+ */
+void mfield_eval(struct mfield *mf, const float *px, const float *py,
+		const float *pz, float *res, float *grad, int n);
+void mfield_eval_scalar(struct mfield *mf, const float *px, const float *py,
+		const float *pz, float *res, float *grad, int n);
+
+/* adds the field of a single ball at n points into res (and grad) */
+void mfield_eval_ball(struct mfield *mf, int ball, const float *px,
+		const float *py, const float *pz, float *res, float *grad, int n);
+
+/* contribution of a single ball at squared distance lensq. Every kernel falls
+ * off with distance, so the field of a ball over any region lies between its
+ * values at the farthest and nearest points. Except at lensq 0, where INVSQ
+ * returns a finite stand-in for its center.
+ */
+float mfield_falloff(struct mfield *mf, int ball, float lensq);
+
+/* builds the spatial index over the box (bmin, bmax) from the support radii
+ * calculated by mfield_kernel. Each grid cell lists every ball reaching within
+ * margin of the cell, so all points within margin of a query point can be
+ * evaluated against the same cell. No index is built if any ball has
+ * infinite support.
+ */
+int mfield_build_grid(struct mfield *mf, const float *bmin, const float *bmax,
+		float margin);
+
+/* same as mfield_eval, but only considers balls near point (x, y, z).
+ * All points must lie within the margin passed to mfield_build_grid.
+ */
+void mfield_eval_near(struct mfield *mf, float x, float y, float z,
+		const float *px, const float *py, const float *pz, float *res,
+		float *grad, int n);
+
+/* builds the per-axis distance tables for a regular grid of res[0] x res[1] x
+ * res[2] voxels, where voxel (x, y, z) is at org + (x, y, z) * step.
+ */
+int mfield_axis_tables(struct mfield *mf, const float *org, const float *step,
+		const int *res);
+
+/* evaluates n consecutive voxels of the grid passed to mfield_axis_tables,
+ * starting at (x0, y, z), considering only balls near point (cx, cy, cz) like
+ * mfield_eval_near. Squared distances come from the tables, so each ball costs
+ * a single add per voxel before the falloff function.
+ */
+void mfield_eval_row(struct mfield *mf, float cx, float cy, float cz,
+		int x0, int y, int z, float *res, float *grad, int n);
+void mfield_eval_row_scalar(struct mfield *mf, float cx, float cy, float cz,
+		int x0, int y, int z, float *res, float *grad, int n);
+
+#endif	/* MFIELD_H_ */
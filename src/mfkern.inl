@@ -0,0 +1,292 @@
+/*
+shapeblobs - 3D metaballs in a shaped window
+Copyright (C) 2016-2026  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Falloff kernel evaluators, included by mfield.c once for each instruction
+ * set. Written in terms of the vfloat/vmask macros defined before inclusion,
+ * and each function processes LANES points against a set of balls. KFUNC
+ * decorates the function names for each instantiation.
+ *
+ * Per point, balls are accumulated in list order, so the scalar and SIMD
+ * instantiations produce the same results (without -ffast-math).
+ */
+
+/* exp(x) for x <= 0, good to ~1e-4 relative down to x = -8: taylor series of
+ * exp(x/8), raised to the 8th power by squaring.
+ */
+static INLINE vfloat KFUNC(vexp)(vfloat x)
+{
+	vfloat y = vmul(x, vset1(0.125f));
+	vfloat p = vadd(vset1(1.0f / 120.0f), vmul(y, vset1(1.0f / 720.0f)));
+	p = vadd(vset1(1.0f / 24.0f), vmul(y, p));
+	p = vadd(vset1(1.0f / 6.0f), vmul(y, p));
+	p = vadd(vset1(0.5f), vmul(y, p));
+	p = vadd(vset1(1.0f), vmul(y, p));
+	p = vadd(vset1(1.0f), vmul(y, p));
+	p = vmul(p, p);
+	p = vmul(p, p);
+	return vmul(p, p);
+}
+
+/* The falloff functions return the contribution of a ball to points at squared
+ * distance lensq, where q = lensq / support^2 (meaningful only for q < 1).
+ */
+
+/* energy / r^2 */
+static INLINE vfloat KFUNC(f_invsq)(vfloat lensq, vfloat q, float energy, float kparam)
+{
+	return vsel(veq(lensq, vset1(0.0f)), vset1(CENTER_VAL),
+			vdiv(vset1(energy), lensq));
+}
+
+/* 1 - 22/9 q + 17/9 q^2 - 4/9 q^3, with q = r^2 / R^2 */
+static INLINE vfloat KFUNC(f_wyvill)(vfloat lensq, vfloat q, float energy, float kparam)
+{
+	vfloat e = vsub(vset1(17.0f / 9.0f), vmul(q, vset1(4.0f / 9.0f)));
+	e = vadd(vset1(-22.0f / 9.0f), vmul(q, e));
+	return vadd(vset1(1.0f), vmul(q, e));
+}
+
+/* 1 - 3 (r/R)^2 for r < R/3, 3/2 (1 - r/R)^2 for r < R */
+static INLINE vfloat KFUNC(f_nishimura)(vfloat lensq, vfloat q, float energy, float kparam)
+{
+	vfloat one = vset1(1.0f);
+	vfloat t = vsub(one, vsqrt(q));
+	return vsel(vlt(q, vset1(1.0f / 9.0f)), vsub(one, vmul(q, vset1(3.0f))),
+			vmul(vset1(1.5f), vmul(t, t)));
+}
+
+/* exp(-B r^2 / R^2), which reaches the cutoff value at the support radius.
+ * In terms of q = r^2 / support^2 that's exp(-kparam * q), kparam = ln(1/cutoff)
+ */
+static INLINE vfloat KFUNC(f_blinn)(vfloat lensq, vfloat q, float energy, float kparam)
+{
+	return KFUNC(vexp)(vmul(vset1(-kparam), q));
+}
+
+/* Derivatives of the falloff functions with respect to lensq, for analytic
+ * gradients. f is the value returned by the falloff function.
+ */
+static INLINE vfloat KFUNC(df_invsq)(vfloat lensq, vfloat q, vfloat f, float irad,
+		float energy, float kparam)
+{
+	/* -energy / r^4 */
+	return vsel(veq(lensq, vset1(0.0f)), vset1(0.0f),
+			vdiv(vset1(-energy), vmul(lensq, lensq)));
+}
+
+static INLINE vfloat KFUNC(df_wyvill)(vfloat lensq, vfloat q, vfloat f, float irad,
+		float energy, float kparam)
+{
+	/* (-22/9 + 34/9 q - 12/9 q^2) / R^2 */
+	vfloat d = vsub(vset1(34.0f / 9.0f), vmul(q, vset1(12.0f / 9.0f)));
+	d = vadd(vset1(-22.0f / 9.0f), vmul(q, d));
+	return vmul(d, vset1(irad));
+}
+
+static INLINE vfloat KFUNC(df_nishimura)(vfloat lensq, vfloat q, vfloat f, float irad,
+		float energy, float kparam)
+{
+	/* -3 / R^2 for r < R/3, -3/2 (1 - r/R) / (r/R) / R^2 for r < R */
+	vfloat s = vsqrt(q);
+	vfloat d = vsel(vlt(q, vset1(1.0f / 9.0f)), vset1(-3.0f),
+			vdiv(vmul(vset1(-1.5f), vsub(vset1(1.0f), s)), s));
+	return vmul(d, vset1(irad));
+}
+
+static INLINE vfloat KFUNC(df_blinn)(vfloat lensq, vfloat q, vfloat f, float irad,
+		float energy, float kparam)
+{
+	return vmul(f, vset1(-kparam * irad));
+}
+
+/* POINT_KERNEL generates the evaluator for arbitrary points, SEP_KERNEL the
+ * one for a row of LANES voxels starting at (x0, y, z), which gets squared
+ * distances from the per-axis tables built by mfield_axis_tables.
+ */
+#define POINT_KERNEL(name) \
+static void KFUNC(name)(const struct bset *bs, const float *px, \
+		const float *py, const float *pz, float *res, float kparam) \
+{ \
+	int j; \
+	vfloat dx, dy, dz, lensq, q; \
+	vmask in; \
+	vfloat x = vload(px); \
+	vfloat y = vload(py); \
+	vfloat z = vload(pz); \
+	vfloat val = vload(res); \
+	vfloat one = vset1(1.0f); \
+ \
+	for(j=0; j<bs->num; j++) { \
+		dx = vsub(vset1(bs->x[j]), x); \
+		dy = vsub(vset1(bs->y[j]), y); \
+		dz = vsub(vset1(bs->z[j]), z); \
+		lensq = vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz)); \
+		q = vmul(lensq, vset1(bs->irad[j])); \
+		in = vlt(q, one); \
+		if(!vany(in)) continue; \
+		val = vadd(val, vand(in, KFUNC(f_##name)(lensq, q, bs->energy[j], kparam))); \
+	} \
+	vstore(res, val); \
+}
+
+/* gradient versions of the above, which also accumulate the negated field
+ * gradient (pointing outwards, like the finite differences in msurf2.c).
+ * -grad f = sum(-2 df/dlensq (p - ball)) = sum(2 df/dlensq (ball - p))
+ */
+#define POINT_GKERNEL(name) \
+static void KFUNC(name##_grad)(const struct bset *bs, const float *px, \
+		const float *py, const float *pz, float *res, float *gx, float *gy, \
+		float *gz, float kparam) \
+{ \
+	int j; \
+	vfloat dx, dy, dz, lensq, q, e, de; \
+	vmask in; \
+	vfloat x = vload(px); \
+	vfloat y = vload(py); \
+	vfloat z = vload(pz); \
+	vfloat val = vload(res); \
+	vfloat grad_x = vload(gx); \
+	vfloat grad_y = vload(gy); \
+	vfloat grad_z = vload(gz); \
+	vfloat one = vset1(1.0f); \
+ \
+	for(j=0; j<bs->num; j++) { \
+		dx = vsub(vset1(bs->x[j]), x); \
+		dy = vsub(vset1(bs->y[j]), y); \
+		dz = vsub(vset1(bs->z[j]), z); \
+		lensq = vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz)); \
+		q = vmul(lensq, vset1(bs->irad[j])); \
+		in = vlt(q, one); \
+		if(!vany(in)) continue; \
+		e = KFUNC(f_##name)(lensq, q, bs->energy[j], kparam); \
+		de = KFUNC(df_##name)(lensq, q, e, bs->irad[j], bs->energy[j], kparam); \
+		de = vand(in, vadd(de, de)); \
+		val = vadd(val, vand(in, e)); \
+		grad_x = vadd(grad_x, vmul(de, dx)); \
+		grad_y = vadd(grad_y, vmul(de, dy)); \
+		grad_z = vadd(grad_z, vmul(de, dz)); \
+	} \
+	vstore(res, val); \
+	vstore(gx, grad_x); \
+	vstore(gy, grad_y); \
+	vstore(gz, grad_z); \
+}
+
+#define SEP_KERNEL(name) \
+static void KFUNC(name##_sep)(const struct bset *bs, const struct mfield *mf, \
+		int x0, int y, int z, float *res, float kparam) \
+{ \
+	int j, b; \
+	vfloat lensq, q; \
+	vmask in; \
+	vfloat val = vload(res); \
+	vfloat one = vset1(1.0f); \
+ \
+	for(j=0; j<bs->num; j++) { \
+		b = bs->idx ? bs->idx[j] : j; \
+		lensq = vadd(vload(mf->tabx + b * mf->tabstride[0] + x0), \
+				vset1(mf->taby[b * mf->tabstride[1] + y] + mf->tabz[b * mf->tabstride[2] + z])); \
+		q = vmul(lensq, vset1(bs->irad[j])); \
+		in = vlt(q, one); \
+		if(!vany(in)) continue; \
+		val = vadd(val, vand(in, KFUNC(f_##name)(lensq, q, bs->energy[j], kparam))); \
+	} \
+	vstore(res, val); \
+}
+
+/* the row x coordinates are passed in px, y and z are common to the row */
+#define SEP_GKERNEL(name) \
+static void KFUNC(name##_sepgrad)(const struct bset *bs, const struct mfield *mf, \
+		int x0, int y, int z, const float *px, float py, float pz, float *res, \
+		float *gx, float *gy, float *gz, float kparam) \
+{ \
+	int j, b; \
+	vfloat dx, lensq, q, e, de, dy, dz; \
+	vmask in; \
+	vfloat x = vload(px); \
+	vfloat val = vload(res); \
+	vfloat grad_x = vload(gx); \
+	vfloat grad_y = vload(gy); \
+	vfloat grad_z = vload(gz); \
+	vfloat one = vset1(1.0f); \
+ \
+	for(j=0; j<bs->num; j++) { \
+		b = bs->idx ? bs->idx[j] : j; \
+		lensq = vadd(vload(mf->tabx + b * mf->tabstride[0] + x0), \
+				vset1(mf->taby[b * mf->tabstride[1] + y] + mf->tabz[b * mf->tabstride[2] + z])); \
+		q = vmul(lensq, vset1(bs->irad[j])); \
+		in = vlt(q, one); \
+		if(!vany(in)) continue; \
+		e = KFUNC(f_##name)(lensq, q, bs->energy[j], kparam); \
+		de = KFUNC(df_##name)(lensq, q, e, bs->irad[j], bs->energy[j], kparam); \
+		de = vand(in, vadd(de, de)); \
+		val = vadd(val, vand(in, e)); \
+		dx = vsub(vset1(bs->x[j]), x); \
+		dy = vset1(bs->y[j] - py); \
+		dz = vset1(bs->z[j] - pz); \
+		grad_x = vadd(grad_x, vmul(de, dx)); \
+		grad_y = vadd(grad_y, vmul(de, dy)); \
+		grad_z = vadd(grad_z, vmul(de, dz)); \
+	} \
+	vstore(res, val); \
+	vstore(gx, grad_x); \
+	vstore(gy, grad_y); \
+	vstore(gz, grad_z); \
+}
+
+POINT_KERNEL(invsq)
+POINT_KERNEL(wyvill)
+POINT_KERNEL(nishimura)
+POINT_KERNEL(blinn)
+
+SEP_KERNEL(invsq)
+SEP_KERNEL(wyvill)
+SEP_KERNEL(nishimura)
+SEP_KERNEL(blinn)
+
+POINT_GKERNEL(invsq)
+POINT_GKERNEL(wyvill)
+POINT_GKERNEL(nishimura)
+POINT_GKERNEL(blinn)
+
+SEP_GKERNEL(invsq)
+SEP_GKERNEL(wyvill)
+SEP_GKERNEL(nishimura)
+SEP_GKERNEL(blinn)
+
+#undef POINT_KERNEL
+#undef SEP_KERNEL
+#undef POINT_GKERNEL
+#undef SEP_GKERNEL
+
+static kern_func KFUNC(kernels)[MFIELD_NUM_KERNELS] = {
+	KFUNC(invsq), KFUNC(wyvill), KFUNC(nishimura), KFUNC(blinn)
+};
+
+static sep_func KFUNC(sep_kernels)[MFIELD_NUM_KERNELS] = {
+	KFUNC(invsq_sep), KFUNC(wyvill_sep), KFUNC(nishimura_sep), KFUNC(blinn_sep)
+};
+
+static gkern_func KFUNC(gkernels)[MFIELD_NUM_KERNELS] = {
+	KFUNC(invsq_grad), KFUNC(wyvill_grad), KFUNC(nishimura_grad), KFUNC(blinn_grad)
+};
+
+static sepg_func KFUNC(sep_gkernels)[MFIELD_NUM_KERNELS] = {
+	KFUNC(invsq_sepgrad), KFUNC(wyvill_sepgrad), KFUNC(nishimura_sepgrad),
+	KFUNC(blinn_sepgrad)
+};
@@ -18,23 +18,204 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
+#include <stddef.h>
+#include <float.h>
 #include "cgmath/cgmath.h"
 #include "msurf2.h"
 #include "mcubes.h"
 
+#ifdef __F16C__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && !defined(MSURF_NO_THREADS)
+#define USE_THREADS
+#include <pthread.h>
+#endif
+
 #define NORMALIZE_GRAD
 #undef NORMALIZE_NORMAL
 
-#define CELL_FRAME_BITS		0x00ff
-#define CELL_CODE_BITS		0xff00
+/* number of voxels along X evaluated together (power of two, <= BRICK_SIZE) */
+#define EVAL_SPAN	8
+
+#define BRICK_SIZE	(1 << MSURF_BRICK_SHIFT)
+#define BRICK_MASK	(BRICK_SIZE - 1)
+
+#define BIT_TEST(bits, b)	((bits)[(b) >> 5] & (1u << ((b) & 31)))
+
+/* volume flags which affect field values */
+#define FIELD_FLAGS	\
+	(MSURF_FLOOR | MSURF_SEPARABLE | MSURF_FDGRAD | MSURF_QUANT16 | MSURF_SPARSE | \
+	 MSURF_AUTOFIT)
+
+/* brick bits are shared between the traversal threads. They're set atomically,
+ * after the state they cover is written, and tested with acquire semantics.
+ */
+#ifdef USE_THREADS
+#define BIT_TEST_SYNC(bits, b) \
+	(__atomic_load_n((bits) + ((b) >> 5), __ATOMIC_ACQUIRE) & (1u << ((b) & 31)))
+#define OR_BITS(word, mask) \
+	do { \
+		if(threaded) { \
+			__sync_fetch_and_or(&(word), mask); \
+		} else { \
+			(word) |= (mask); \
+		} \
+	} while(0)
+#else
+#define BIT_TEST_SYNC(bits, b)	BIT_TEST(bits, b)
+#define OR_BITS(word, mask)	((word) |= (mask))
+#endif
+#define BIT_SET_SYNC(bits, b)	OR_BITS((bits)[(b) >> 5], 1u << ((b) & 31))
+
+#ifdef __GNUC__
+#define ctz(x)	__builtin_ctz(x)
+#else
+static INLINE int ctz(unsigned int x)
+{
+	int n = 0;
+	while(!(x & 1)) {
+		x >>= 1;
+		n++;
+	}
+	return n;
+}
+#endif
+
+/* default MSURF_AUTODENSE threshold */
+#define DEF_DENSE_RATIO	0.12f
+
+/* hand work to idle threads only from open lists at least this long */
+#define SHARE_MIN	4
+
+/* each level of the min/max pyramid halves the bricks along each axis */
+#define PYR_MAX_LEVELS	16
+
+/* MSURF_SPARSE: frames a brick is kept after the metaballs left it (default),
+ * and voxels of padding around their reach, for the cells and finite
+ * difference gradients reaching out of it
+ */
+#define DEF_SPARSE_KEEP	4
+#define SPARSE_PAD		2
+
+/* bricks per slab handed out by the dense bounding pass in sparse volumes */
+#define SPARSE_SLAB		16
+
+/* MSURF_AUTOFIT: room left around the box the metaballs reach when fitting,
+ * as a fraction of its size, and the default fit_shrink
+ */
+#define FIT_SLACK		0.25f
+#define DEF_FIT_SHRINK	1.6f
+
+/* brick field bounds are padded by this much of the magnitude of the terms,
+ * for rounding in the evaluators and MSURF_QUANT16, plus a few ulps per ball
+ * for the polynomial kernels, which cancel out to 0 at their edge. Squared
+ * distances to the box are nudged by BOUND_NUDGE, to stay clear of the edge.
+ */
+#define BOUND_EPS		2e-3f
+#define BOUND_ULPS		(8.0f * FLT_EPSILON)
+#define BOUND_NUDGE		2e-4f
+
+/* whether the field bounds of a brick leave room for the isovalue */
+#define STRADDLES(brk, iso)	((brk)->lo <= (iso) && (brk)->hi > (iso))
+
+struct range {
+	float min, max;
+};
+
+/* open list entry: a brick with pending cells, or a cell of a seed still
+ * looking for the surface
+ */
+struct open_cell {
+	int addr;		/* brick index for OPEN_BRICK, cell address otherwise */
+	int seed;		/* OPEN_BRICK or seed index */
+};
+#define OPEN_BRICK	-1
+
+/* per-thread traversal state. Open cells are kept in a private stack, and
+ * whenever other threads run dry, the oldest ones are moved to the public
+ * array for them to steal.
+ */
+struct worker {
+	struct open_cell *open;		/* private open cells [bot, top) */
+	int bot, top, max_open;
+
+	struct msurf_vertex *varr;	/* vertices generated by this thread */
+	unsigned int num_verts, max_verts;
+	int *surf;					/* surface cells found, seeds for the next frame */
+	int num_surf, max_surf;
+	int visited, evaluated, probes;
+	float isoval;				/* isovalue being extracted */
+#ifdef USE_THREADS
+	struct msurf_volume *vol;
+	pthread_t thread;
+	pthread_mutex_t lock;		/* protects the public open cells */
+	struct open_cell *pub;
+	int num_pub, max_pub;
+#endif
+};
+
+struct msurf_traversal {
+	struct worker *workers;
+	int num_workers, max_workers;
+
+	/* starting cells: the previous frame's surface cells, which don't look
+	 * for the surface, followed by the metaball and floor seeds, which do.
+	 */
+	int *seeds;
+	int num_seeds, max_seeds, num_prev, floor_seed, next_seed;
+	int *seed_found;			/* set when a searching seed reaches the surface */
+	int max_found;
+
+	/* dense mode: first the slabs are evaluated and their brick ranges updated,
+	 * then the bricks the pyramid can't rule out are swept twice: once to count
+	 * their vertices, and once to write them at the offsets in voffs
+	 */
+	int dense, bounding, counting, slab, next_slab;
+	int extract;				/* msurf_extract: don't record surface cells */
+	float isoval;
+	struct range *pyr;			/* pyramid levels above the bricks */
+	int pyr_levels, pyr_dim[PYR_MAX_LEVELS][3], pyr_offs[PYR_MAX_LEVELS];
+	int *sweep, num_sweep, next_sweep;
+	unsigned int *voffs;		/* num_sweep + 1 entries */
+
+	/* cells found by following the surface are marked pending in their brick,
+	 * and each brick with pending cells is queued once, to process them in
+	 * storage order while its voxels are in cache.
+	 */
+	unsigned int *pending;		/* MSURF_BRICK_WORDS per brick */
+	int *queued;
+	unsigned int max_bricks;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;		/* protects the fields below */
+	pthread_cond_t cond;
+	volatile int num_idle;
+	int num_pub, done;
+#endif
+};
 
-int dbg_visited;
+int dbg_visited, dbg_evaluated, dbg_probes;
 static unsigned int frmid;
+#ifdef USE_THREADS
+static int threaded;
+#endif
 
 
-static unsigned int next_pow2(unsigned int x);
-static unsigned int calc_shift(unsigned int x);
+static INLINE void dirty_brick(struct msurf_brick *brk);
+static void dirty_sphere(struct msurf_volume *vol, cgm_vec3 *pos, float rad);
+static void eval_span(struct msurf_volume *vol, struct worker *w, struct msurf_brick *brk,
+		int x, int y, int z);
+static void splat_field(struct msurf_volume *vol);
+static int init_static(struct msurf_volume *vol);
+static int calc_tables(struct msurf_volume *vol);
+static void bake_brick(struct msurf_volume *vol, int b);
+static void bound_field(struct msurf_volume *vol, struct msurf_brick *brk);
+static int update_bricks(struct msurf_volume *vol);
+static int fit_volume(struct msurf_volume *vol);
+static void free_traversal(struct msurf_traversal *trav);
 
 
 int msurf_init(struct msurf_volume *vol)
@@ -46,14 +227,26 @@ int msurf_init(struct msurf_volume *vol)
 void msurf_destroy(struct msurf_volume *vol)
 {
 	free(vol->voxels);
-	free(vol->cells);
+	free(vol->qval);
+	free(vol->codes);
+	free(vol->xpos);
 	free(vol->varr);
 	free(vol->mballs);
+	free(vol->bricks);
+	free(vol->visited);
+	free(vol->bhash);
+	free(vol->bstate);
+	free(vol->static_mballs);
+	free(vol->base);
+	free(vol->base_grad);
+	free_traversal(vol->trav);
+	mfield_destroy(&vol->field);
+	mfield_destroy(&vol->sfield);
 }
 
 void msurf_resolution(struct msurf_volume *vol, int x, int y, int z)
 {
-	if(x == vol->xres && y == vol->yres && z == vol->zres) {
+	if(x == (int)vol->xres && y == (int)vol->yres && z == (int)vol->zres) {
 		return;
 	}
 	vol->xres = x;
@@ -73,368 +266,3164 @@ void msurf_size(struct msurf_volume *vol, float x, float y, float z)
 	vol->flags &= ~MSURF_POSVALID;
 }
 
+/* resizes the metaball array, existing metaballs are preserved */
 int msurf_metaballs(struct msurf_volume *vol, int count)
 {
 	struct msurf_metaball *mballs;
-	if(!(mballs = malloc(count * sizeof *mballs))) {
+	if(!(mballs = realloc(vol->mballs, count * sizeof *mballs))) {
 		fprintf(stderr, "failed to allocate %d metaballs\n", count);
 		return -1;
 	}
-	free(vol->mballs);
 	vol->mballs = mballs;
 	vol->num_mballs = count;
 	return 0;
 }
 
+int msurf_static_metaballs(struct msurf_volume *vol, int count)
+{
+	struct msurf_metaball *mballs;
+	if(!(mballs = realloc(vol->static_mballs, count * sizeof *mballs))) {
+		fprintf(stderr, "failed to allocate %d static metaballs\n", count);
+		return -1;
+	}
+	vol->static_mballs = mballs;
+	vol->num_static_mballs = count;
+	vol->flags &= ~MSURF_STATICVALID;
+	return 0;
+}
+
 static const int celloffs[][3] = {
 	{0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
 	{0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}
 };
 
-int msurf_begin(struct msurf_volume *vol)
+/* celloffs as offsets in the brick bitsets */
+#define BOFFS(x, y, z)	((x) + (y) * BRICK_SIZE + (z) * BRICK_SIZE * BRICK_SIZE)
+static const int cellboffs[] = {
+	BOFFS(0, 0, 0), BOFFS(1, 0, 0), BOFFS(1, 1, 0), BOFFS(0, 1, 0),
+	BOFFS(0, 0, 1), BOFFS(1, 0, 1), BOFFS(1, 1, 1), BOFFS(0, 1, 1)
+};
+
+/* offsets to the next voxel along each axis within a brick */
+static const int axis_step[3] = {1, BRICK_SIZE, BRICK_SIZE * BRICK_SIZE};
+
+/* index of the brick offset by (x, y, z) in the neighbors of a brick */
+#define NBR(x, y, z)	((((z) + 1) * 3 + (y) + 1) * 3 + (x) + 1)
+
+/* bit of voxel (or cell) x, y, z in the bitsets of its brick */
+static INLINE int brick_bit(int x, int y, int z)
 {
-	int i, x, y, z, vx, vy, vz;
-	struct msurf_cell *cell;
-	struct msurf_voxel *vox;
+	return (x & BRICK_MASK) | ((y & BRICK_MASK) << MSURF_BRICK_SHIFT) |
+		((z & BRICK_MASK) << (MSURF_BRICK_SHIFT * 2));
+}
 
-	if(!(vol->flags & MSURF_VALID)) {
-		vol->xstore = next_pow2(vol->xres);
-		vol->ystore = next_pow2(vol->yres);
-		vol->xystore = vol->xstore * vol->ystore;
-		vol->xshift = calc_shift(vol->xstore);
-		vol->yshift = calc_shift(vol->ystore);
-		vol->xyshift = vol->xshift + vol->yshift;
-		vol->num_store = vol->xstore * vol->ystore * vol->zres;
+/* storage address of voxel (x, y, z) of brick brk */
+static INLINE int brick_addr(struct msurf_volume *vol, struct msurf_brick *brk,
+		int x, int y, int z)
+{
+	return (int)(brk - vol->bricks) * MSURF_BRICK_VOXELS + brick_bit(x, y, z);
+}
 
-		free(vol->voxels);
-		free(vol->cells);
+/* the brick of voxel (x, y, z), which must be brk or one of its neighbors */
+static INLINE struct msurf_brick *near_brick(struct msurf_volume *vol,
+		struct msurf_brick *brk, int x, int y, int z)
+{
+	return vol->bricks + brk->nbr[NBR((x - brk->x) >> MSURF_BRICK_SHIFT,
+			(y - brk->y) >> MSURF_BRICK_SHIFT, (z - brk->z) >> MSURF_BRICK_SHIFT)];
+}
 
-		if(!(vol->voxels = calloc(vol->num_store, sizeof *vol->voxels))) {
-			fprintf(stderr, "failed to allocate voxels\n");
-			return -1;
-		}
-		if(!(vol->cells = malloc(vol->num_store * sizeof *vol->cells))) {
-			fprintf(stderr, "failed to allocate volume cells\n");
-			free(vol->voxels);
-			return -1;
-		}
+static INLINE unsigned int hash_brick(int bx, int by, int bz)
+{
+	return ((unsigned int)bx * 73856093u) ^ ((unsigned int)by * 19349663u) ^
+		((unsigned int)bz * 83492791u);
+}
 
-		cell = vol->cells;
-		for(z=0; z<vol->zres; z++) {
-			for(y=0; y<vol->ystore; y++) {
-				for(x=0; x<vol->xstore; x++) {
-					/* vol==0 for padding cells not part of the volume */
-					if(x >= vol->xres - 1 || y >= vol->yres - 1 || z >= vol->zres - 1) {
-						memset(cell, 0, sizeof *cell);
-						cell->x = x;
-						cell->y = y;
-						cell->z = z;
-					} else {
-						cell->vol = vol;
-						cell->x = x;
-						cell->y = y;
-						cell->z = z;
-						for(i=0; i<8; i++) {
-							vx = x + celloffs[i][0];
-							vy = y + celloffs[i][1];
-							vz = z + celloffs[i][2];
-							cell->vox[i] = vol->voxels + msurf_addr(vol, vx, vy, vz);
-							assert(msurf_addr(vol, vx, vy, vz) == vz * vol->xystore + vy * vol->xstore + vx);
-							assert(cell->vox[i] >= vol->voxels);
-							assert(cell->vox[i] < vol->voxels + vol->num_store);
-						}
-						cell->flags = 0;
-					}
-					cell++;
-				}
-			}
+/* index of the brick at brick coordinates (bx, by, bz), -1 if there's none */
+static int find_brick(struct msurf_volume *vol, int bx, int by, int bz)
+{
+	int b;
+	unsigned int h;
+	struct msurf_brick *brk;
+
+	if(!(vol->flags & MSURF_SPARSE)) {
+		if(bx < 0 || by < 0 || bz < 0 || bx >= (int)vol->bxres ||
+				by >= (int)vol->byres || bz >= (int)vol->bzres) {
+			return -1;
 		}
+		return (bz * vol->byres + by) * vol->bxres + bx;
 	}
 
-	if(!(vol->flags & MSURF_POSVALID)) {
-		vox = vol->voxels;
-		for(z=0; z<vol->zres; z++) {
-			for(y=0; y<vol->yres; y++) {
-				for(x=0; x<vol->xres; x++) {
-					msurf_cell_to_pos(vol, x, y, z, &vox->pos);
-					vox++;
-				}
-				vox += vol->xstore - vol->xres;
-			}
-			vox += (vol->ystore - vol->yres) << vol->xshift;
+	if(!vol->hash_size) return -1;
+	h = hash_brick(bx, by, bz) & (vol->hash_size - 1);
+	while((b = vol->bhash[h]) >= 0) {
+		brk = vol->bricks + b;
+		if(brk->x >> MSURF_BRICK_SHIFT == bx && brk->y >> MSURF_BRICK_SHIFT == by &&
+				brk->z >> MSURF_BRICK_SHIFT == bz) {
+			return b;
 		}
+		h = (h + 1) & (vol->hash_size - 1);
 	}
+	return -1;
+}
 
-	if(!(vol->flags & MSURF_VALID) || !(vol->flags & MSURF_POSVALID)) {
-		vol->dx = vol->size.x / vol->xres;
-		vol->dy = vol->size.y / vol->yres;
-		vol->dz = vol->size.z / vol->zres;
+/* storage address of voxel (x, y, z), -1 if its brick doesn't exist */
+static int voxel_addr(struct msurf_volume *vol, int x, int y, int z)
+{
+	int b = find_brick(vol, x >> MSURF_BRICK_SHIFT, y >> MSURF_BRICK_SHIFT,
+			z >> MSURF_BRICK_SHIFT);
+	return b < 0 ? -1 : b * MSURF_BRICK_VOXELS + brick_bit(x, y, z);
+}
 
-		vol->flags |= MSURF_VALID | MSURF_POSVALID;
-	}
+/* cells are implicit: each one is identified by the storage address of its
+ * first corner, and everything else is derived from that on the fly
+ */
+struct cell {
+	int addr;
+	int x, y, z;
+	int inbrick;				/* doesn't touch the far sides of its brick */
+	struct msurf_voxel *vox;	/* first corner */
+	const int *offs;			/* corner offsets from vox, 0 if some aren't stored */
+};
 
-	vol->num_verts = 0;
-	vol->cur++;
-	frmid = vol->cur & 0xffff;
-	dbg_visited = 0;
-	return 0;
+static INLINE void init_cell(struct msurf_volume *vol, struct cell *cell, int addr,
+		int x, int y, int z)
+{
+	struct msurf_brick *brk = vol->bricks + addr / MSURF_BRICK_VOXELS;
+	int sides = ((x & BRICK_MASK) == BRICK_MASK) | (((y & BRICK_MASK) == BRICK_MASK) << 1) |
+		(((z & BRICK_MASK) == BRICK_MASK) << 2);
+
+	cell->addr = addr;
+	cell->x = x;
+	cell->y = y;
+	cell->z = z;
+	cell->inbrick = !sides;
+	cell->vox = vol->voxels + addr;
+	cell->offs = (brk->cmask >> sides) & 1 ? brk->cornoffs[sides] : 0;
 }
 
-static void calc_grad(struct msurf_volume *vol, int x, int y, int z, cgm_vec3 *grad)
+/* inverse of msurf_addr, for cells only known by address */
+static INLINE void addr_cell(struct msurf_volume *vol, struct cell *cell, int addr)
 {
-	struct msurf_voxel *ptr = vol->voxels + msurf_addr(vol, x, y, z);
-	if(x < vol->xres - 1) {
-		grad->x = ptr->val - ptr[1].val;
-	} else {
-		grad->x = ptr[-1].val - ptr->val;
-	}
-	if(y < vol->yres - 1) {
-		grad->y = ptr->val - ptr[vol->xstore].val;
-	} else {
-		grad->y = ptr[-(int)vol->xstore].val - ptr->val;
-	}
-	if(z < vol->zres - 1) {
-		grad->z = ptr->val - ptr[vol->xystore].val;
-	} else {
-		grad->z = ptr[-(int)vol->xystore].val - ptr->val;
-	}
-#ifdef NORMALIZE_GRAD
-	cgm_vnormalize(grad);
-#endif
+	struct msurf_brick *brk = vol->bricks + addr / MSURF_BRICK_VOXELS;
+	int bit = addr & (MSURF_BRICK_VOXELS - 1);
+
+	init_cell(vol, cell, addr, brk->x | (bit & BRICK_MASK),
+			brk->y | (bit >> MSURF_BRICK_SHIFT & BRICK_MASK),
+			brk->z | (bit >> (MSURF_BRICK_SHIFT * 2)));
 }
 
-int msurf_proc_cell(struct msurf_volume *vol, struct msurf_cell *cell)
+#define cell_corner(vol, cell, i)	((cell)->vox + (cell)->offs[i])
+
+/* offsets to the next and previous voxel along an axis, from a voxel of brick
+ * brk at coordinate c along it. Steps out of a brick land in the neighboring
+ * brick, and are 0 if there's none.
+ */
+#define NEXT_OFFS(brk, axis, c) \
+	(((c) & BRICK_MASK) == BRICK_MASK ? (brk)->step[axis][1] : axis_step[axis])
+#define PREV_OFFS(brk, axis, c) \
+	(((c) & BRICK_MASK) == 0 ? (brk)->step[axis][0] : -axis_step[axis])
+
+/* works out the steps and corner offsets of brick b from its neighbors */
+static void calc_links(struct msurf_volume *vol, int b)
 {
-	int i, j, x, y, z, p0, p1;
-	float t, lensq;
-	unsigned int code;
-	struct msurf_vertex vert[12];
-	struct msurf_voxel *vox, *vox0, *vox1;
-	cgm_vec3 dir;
+	int i, j, k, n, offs, d[3];
+	struct msurf_brick *brk = vol->bricks + b;
 
-	static const int pidx[12][2] = {
-		{0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6},
-		{6, 7},	{7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}
-	};
+	for(i=0; i<3; i++) {
+		d[0] = d[1] = d[2] = 0;
+		d[i] = -1;
+		n = brk->nbr[NBR(d[0], d[1], d[2])];
+		brk->step[i][0] = n < 0 ? 0 : (n - b) * MSURF_BRICK_VOXELS + BRICK_MASK * axis_step[i];
+		d[i] = 1;
+		n = brk->nbr[NBR(d[0], d[1], d[2])];
+		brk->step[i][1] = n < 0 ? 0 : (n - b) * MSURF_BRICK_VOXELS - BRICK_MASK * axis_step[i];
+	}
 
-	/* update the metaball field if necessary */
+	/* corners of cells on the far sides of the brick are in the next bricks
+	 * along those axes
+	 */
+	brk->cmask = 0;
 	for(i=0; i<8; i++) {
-		vox = cell->vox[i];
-		if((vox->flags & 0xffff) != frmid) {
-			if(vol->flags & MSURF_FLOOR) {
-				float dz = vox->pos.z - vol->floor_z;
-				if(dz > 0) {
-					vox->val = vol->floor_energy / dz;
-				}
-			} else {
-				vox->val = 0;
+		for(j=0; j<8; j++) {
+			for(k=0; k<3; k++) {
+				d[k] = celloffs[j][k] && (i & (1 << k));
 			}
-			for(j=0; j<vol->num_mballs; j++) {
-				dir = vol->mballs[j].pos;
-				cgm_vsub(&dir, &vox->pos);
-				lensq = cgm_vlength_sq(&dir);
-				vox->val += lensq == 0.0f ? 1024.0f : vol->mballs[j].energy / lensq;
+			if((n = brk->nbr[NBR(d[0], d[1], d[2])]) < 0) break;
+
+			offs = (n - b) * MSURF_BRICK_VOXELS;
+			for(k=0; k<3; k++) {
+				if(celloffs[j][k]) {
+					offs += d[k] ? -BRICK_MASK * axis_step[k] : axis_step[k];
+				}
 			}
-			vox->flags = (vox->flags & ~0xffff) | frmid;
+			brk->cornoffs[i][j] = offs;
+		}
+		if(j >= 8) {
+			brk->cmask |= 1 << i;
 		}
 	}
+}
 
-	/* calculcate the marching cubes bit code */
-	code = 0;
-	for(i=0; i<8; i++) {
-		if(cell->vox[i]->val > vol->isoval) {
-			code |= 1 << i;
+/* updates brick b after one of its neighbors came or went. Its range and
+ * finite difference gradients reach into the neighbors, its field doesn't.
+ */
+static void relink_brick(struct msurf_volume *vol, int b)
+{
+	struct msurf_brick *brk = vol->bricks + b;
+
+	calc_links(vol, b);
+	brk->rvalid = 0;
+	memset(brk->gvalid, 0, sizeof brk->gvalid);
+}
+
+/* looks up the neighbors of brick b. If relink is set, they're also told
+ * about it, for bricks added to a sparse volume.
+ */
+static void link_brick(struct msurf_volume *vol, int b, int relink)
+{
+	int x, y, z, n, bx, by, bz;
+	struct msurf_brick *brk = vol->bricks + b;
+
+	bx = brk->x >> MSURF_BRICK_SHIFT;
+	by = brk->y >> MSURF_BRICK_SHIFT;
+	bz = brk->z >> MSURF_BRICK_SHIFT;
+	for(z=-1; z<=1; z++) {
+		for(y=-1; y<=1; y++) {
+			for(x=-1; x<=1; x++) {
+				n = find_brick(vol, bx + x, by + y, bz + z);
+				brk->nbr[NBR(x, y, z)] = n;
+				if(relink && n >= 0 && n != b) {
+					vol->bricks[n].nbr[NBR(-x, -y, -z)] = b;
+					relink_brick(vol, n);
+				}
+			}
 		}
 	}
-	cell->flags = (code << 16) | frmid;
+	calc_links(vol, b);
+}
 
-	if(code == 0 || code == 0xff) return 0;
+/* resizes the brick pool and everything stored per brick */
+static int grow_bricks(struct msurf_volume *vol, unsigned int count)
+{
+	unsigned int num_store = count * MSURF_BRICK_VOXELS;
+	void *tmp;
 
-	/* for each of the voxels, make sure we have valid gradients */
-	for(i=0; i<8; i++) {
-		if((cell->vox[i]->flags & 0xffff0000) != (frmid << 16)) {
-			x = cell->x + celloffs[i][0];
-			y = cell->y + celloffs[i][1];
-			z = cell->z + celloffs[i][2];
-			calc_grad(vol, x, y, z, &cell->vox[i]->grad);
-			cell->vox[i]->flags = (cell->vox[i]->flags & ~0xffff0000) | (frmid << 16);
+	if(!(tmp = realloc(vol->bricks, count * sizeof *vol->bricks))) {
+		fprintf(stderr, "failed to allocate volume bricks\n");
+		return -1;
+	}
+	vol->bricks = tmp;
+	if(!(tmp = realloc(vol->voxels, num_store * sizeof *vol->voxels))) {
+		fprintf(stderr, "failed to allocate voxels\n");
+		return -1;
+	}
+	vol->voxels = tmp;
+	memset(vol->voxels + vol->num_store, 0, (num_store - vol->num_store) * sizeof *vol->voxels);
+	if(!(tmp = realloc(vol->codes, num_store * sizeof *vol->codes))) {
+		fprintf(stderr, "failed to allocate cell codes\n");
+		return -1;
+	}
+	vol->codes = tmp;
+	if(!(tmp = realloc(vol->visited, ((num_store + 31) >> 5) * sizeof *vol->visited))) {
+		fprintf(stderr, "failed to allocate visited cell bits\n");
+		return -1;
+	}
+	vol->visited = tmp;
+	if(vol->qval || (vol->flags & MSURF_QUANT16)) {
+		if(!(tmp = realloc(vol->qval, num_store * sizeof *vol->qval))) {
+			fprintf(stderr, "failed to allocate quantized field values\n");
+			return -1;
+		}
+		vol->qval = tmp;
+	}
+	if(vol->base) {
+		if(!(tmp = realloc(vol->base, num_store * sizeof *vol->base))) {
+			fprintf(stderr, "failed to allocate static field\n");
+			return -1;
 		}
+		vol->base = tmp;
+		if(!(tmp = realloc(vol->base_grad, num_store * sizeof *vol->base_grad))) {
+			fprintf(stderr, "failed to allocate static field\n");
+			return -1;
+		}
+		vol->base_grad = tmp;
 	}
+	vol->max_bricks = count;
+	vol->num_store = num_store;
+	return 0;
+}
 
-	/* generate up to max 12 verts per cube. interpolate positions and normals for each one */
-	for(i=0; i<12; i++) {
-		if(mc_edge_table[code] & (1 << i)) {
-			p0 = pidx[i][0];
-			p1 = pidx[i][1];
-			vox0 = cell->vox[p0];
-			vox1 = cell->vox[p1];
+/* rebuilds the brick hash table of a sparse volume, sized to stay at most half
+ * full with count bricks
+ */
+static int rehash_bricks(struct msurf_volume *vol, unsigned int count)
+{
+	unsigned int i, h, size = 64;
+	int *tmp;
 
-			t = (vol->isoval - vox0->val) / (vox1->val - vox0->val);
-			vert[i].x = vox0->pos.x + (vox1->pos.x - vox0->pos.x) * t;
-			vert[i].y = vox0->pos.y + (vox1->pos.y - vox0->pos.y) * t;
-			vert[i].z = vox0->pos.z + (vox1->pos.z - vox0->pos.z) * t;
-			vert[i].nx = vox0->grad.x + (vox1->grad.x - vox0->grad.x) * t;
-			vert[i].ny = vox0->grad.y + (vox1->grad.y - vox0->grad.y) * t;
-			vert[i].nz = vox0->grad.z + (vox1->grad.z - vox0->grad.z) * t;
-#ifdef NORMALIZE_NORMAL
-			cgm_vnormalize((cgm_vec3*)&vert[i].nx);
-#endif
+	while(size < count * 2) size <<= 1;
+	if(size != vol->hash_size) {
+		if(!(tmp = realloc(vol->bhash, size * sizeof *vol->bhash))) {
+			fprintf(stderr, "failed to allocate brick hash table\n");
+			return -1;
 		}
+		vol->bhash = tmp;
+		vol->hash_size = size;
 	}
+	memset(vol->bhash, 0xff, size * sizeof *vol->bhash);
 
-	/* for each generated triangle, add its vertices to the vertex buffer */
-	for(i=0; mc_tri_table[code][i] != -1; i+=3) {
-		for(j=0; j<3; j++) {
-			int idx = mc_tri_table[code][i + (2 - j)];
-			struct msurf_vertex *newv;
-
-			if(vol->num_verts >= vol->max_verts) {
-				int newsz = vol->max_verts ? vol->max_verts * 2 : 32;
-				if(!(newv = realloc(vol->varr, newsz * sizeof *vol->varr))) {
-					fprintf(stderr, "msurf2: failed to resize vertex array\n");
-					abort();
-				}
-				vol->varr = newv;
-				vol->max_verts = newsz;
-			}
+	for(i=0; i<vol->num_bricks; i++) {
+		struct msurf_brick *brk = vol->bricks + i;
+		if(!brk->used) continue;
+		h = hash_brick(brk->x >> MSURF_BRICK_SHIFT, brk->y >> MSURF_BRICK_SHIFT,
+				brk->z >> MSURF_BRICK_SHIFT) & (size - 1);
+		while(vol->bhash[h] >= 0) {
+			h = (h + 1) & (size - 1);
+		}
+		vol->bhash[h] = i;
+	}
+	return 0;
+}
+
+/* adds a brick to a sparse volume, from the free list if possible. It starts
+ * out with a 0 stamp, to be baked and marked dirty once it's in place.
+ */
+static int alloc_brick(struct msurf_volume *vol, int bx, int by, int bz)
+{
+	int b;
+	unsigned int h;
+	struct msurf_brick *brk;
 
-			vol->varr[vol->num_verts++] = vert[idx];
+	if((vol->num_live + 1) * 2 > vol->hash_size && rehash_bricks(vol, vol->num_live + 1) == -1) {
+		return -1;
+	}
+	if(vol->free_brick >= 0) {
+		b = vol->free_brick;
+		vol->free_brick = vol->bricks[b].next_free;
+	} else {
+		if(vol->num_bricks >= vol->max_bricks &&
+				grow_bricks(vol, vol->max_bricks ? vol->max_bricks * 2 : 64) == -1) {
+			return -1;
 		}
+		b = vol->num_bricks++;
 	}
 
-	return 1;
-}
+	brk = vol->bricks + b;
+	memset(brk, 0, sizeof *brk);
+	brk->used = frmid;
+	brk->x = bx * BRICK_SIZE;
+	brk->y = by * BRICK_SIZE;
+	brk->z = bz * BRICK_SIZE;
 
-#define ADDOPEN(dir, c) \
-	do { \
-		struct msurf_cell *cp = (c); \
-		if((dirvalid & dir) == dir && ((cp->flags & 0xffff) != frmid)) { \
-			cp->next = openlist; \
-			openlist = cp; \
-			cp->flags = (cp->flags & ~0xffff) | frmid; \
-		} \
-	} while(0)
+	h = hash_brick(bx, by, bz) & (vol->hash_size - 1);
+	while(vol->bhash[h] >= 0) {
+		h = (h + 1) & (vol->hash_size - 1);
+	}
+	vol->bhash[h] = b;
+	vol->num_live++;
 
-/* start from the center of each metaball and go outwards until we hit the
- * isosurface, then follow it
+	link_brick(vol, b, 1);
+	return b;
+}
+
+/* returns a brick of a sparse volume to the free list. The hash table must be
+ * rebuilt before the next lookup.
  */
-void msurf_genmesh(struct msurf_volume *vol)
+static void free_brick(struct msurf_volume *vol, int b)
 {
-	int i, cx, cy, cz, foundsurf, num_msurf;
-	unsigned int dirvalid = 0;
-	struct msurf_cell *cell, *cellptr, *openlist = 0;
+	int i, n;
+	struct msurf_brick *brk = vol->bricks + b;
 
-	num_msurf = vol->num_mballs;
-	if(vol->flags & MSURF_FLOOR) {
-		num_msurf++;
+	for(i=0; i<27; i++) {
+		if((n = brk->nbr[i]) >= 0 && n != b) {
+			vol->bricks[n].nbr[26 - i] = -1;
+			relink_brick(vol, n);
+		}
 	}
+	brk->used = 0;
+	brk->next_free = vol->free_brick;
+	vol->free_brick = b;
+	vol->num_live--;
+}
 
-	for(i=0; i<num_msurf; i++) {
-		if(i >= vol->num_mballs) {
-			/* start from z=floor_z and go upwards until we meet the floor */
-			cz = (float)(vol->floor_z * vol->zres / vol->size.z) - 1;
-			if(cz >= (int)vol->zres - 2) continue;
-			if(cz <= 0) {
-				cell = vol->cells;
-			} else {
-				cell = vol->cells + (cz << vol->xyshift);
+int msurf_begin(struct msurf_volume *vol)
+{
+	int full_update = 0, new_tables = 0, sparse, worg[3], wres[3];
+	unsigned int i, n;
+	float bmin[3], bmax[3], eps_sq;
+	struct msurf_brick *brk;
+
+	/* switching to or from sparse mode, or changing the voxel spacing of a
+	 * sparse volume, starts over with new bricks
+	 */
+	sparse = vol->flags & MSURF_SPARSE;
+	if(((vol->flags ^ vol->last_fflags) & MSURF_SPARSE) ||
+			(sparse && !(vol->flags & MSURF_POSVALID))) {
+		vol->flags &= ~MSURF_VALID;
+	}
+
+	if((vol->flags & MSURF_AUTOFIT) && !sparse && fit_volume(vol) == -1) {
+		return -1;
+	}
+
+	if(!(frmid = ++vol->cur)) {
+		frmid = ++vol->cur;		/* 0 is the stamp of fresh bricks */
+	}
+
+	if(!(vol->flags & MSURF_VALID)) {
+		free(vol->voxels);
+		free(vol->qval);
+		free(vol->codes);
+		free(vol->xpos);
+		free(vol->bricks);
+		free(vol->visited);
+		free(vol->bhash);
+		free(vol->base);
+		free(vol->base_grad);
+		free_traversal(vol->trav);	/* its seeds are cell addresses */
+		vol->voxels = 0;
+		vol->qval = 0;
+		vol->codes = 0;
+		vol->xpos = 0;
+		vol->bricks = 0;
+		vol->visited = 0;
+		vol->bhash = 0;
+		vol->base = 0;
+		vol->base_grad = 0;
+		vol->trav = 0;
+		vol->num_store = vol->max_tab = 0;
+		vol->num_bricks = vol->max_bricks = vol->num_live = 0;
+		vol->hash_size = 0;
+		vol->free_brick = -1;
+
+		if(sparse) {
+			vol->bxres = vol->byres = vol->bzres = 0;
+			for(i=0; i<3; i++) {
+				vol->worg[i] = vol->wres[i] = 0;
 			}
 		} else {
-			/* start from the center of the ball */
-			msurf_pos_to_cell(vol, vol->mballs[i].pos, &cx, &cy, &cz);
-			if(cx < 0) cx = 0; else if(cx >= vol->xres - 2) cx = vol->xres - 3;
-			if(cy < 0) cy = 0; else if(cy >= vol->yres - 2) cy = vol->yres - 3;
-			if(cz < 0) cz = 0; else if(cz >= vol->zres - 2) cz = vol->zres - 3;
-			cell = vol->cells + msurf_addr(vol, cx, cy, cz);
-		}
-		ADDOPEN(0, cell);
+			vol->bxres = (vol->xres + BRICK_SIZE - 1) >> MSURF_BRICK_SHIFT;
+			vol->byres = (vol->yres + BRICK_SIZE - 1) >> MSURF_BRICK_SHIFT;
+			vol->bzres = (vol->zres + BRICK_SIZE - 1) >> MSURF_BRICK_SHIFT;
+			n = vol->bxres * vol->byres * vol->bzres;
+			if(grow_bricks(vol, n) == -1) {
+				return -1;
+			}
+			vol->num_bricks = vol->num_live = n;
 
-		foundsurf = 0;
-		while(openlist) {
-			cell = openlist;
-			openlist = openlist->next;
+			brk = vol->bricks;
+			for(i=0; i<n; i++) {
+				memset(brk, 0, sizeof *brk);
+				brk->used = 1;
+				brk->x = (i % vol->bxres) << MSURF_BRICK_SHIFT;
+				brk->y = (i / vol->bxres % vol->byres) << MSURF_BRICK_SHIFT;
+				brk->z = (i / (vol->bxres * vol->byres)) << MSURF_BRICK_SHIFT;
+				brk++;
+			}
+			for(i=0; i<n; i++) {
+				link_brick(vol, i, 0);
+			}
 
-			dbg_visited++;
+			vol->worg[0] = vol->worg[1] = vol->worg[2] = 0;
+			vol->wres[0] = vol->xres;
+			vol->wres[1] = vol->yres;
+			vol->wres[2] = vol->zres;
+		}
+	}
 
-			/* each bit is 1 if it has cells to the corresponding side, then in
-			 * ADDOPEN we test (dirvalid & dir) == dir, to make sure all required
-			 * direction bits are set before attempting to add the cell.
-			 * Bits [0,5] are [... | +Z +Y +X | -Z -Y -X] <- bit 0 is -X.
-			 */
-			dirvalid = 0;
-			if(cell->x > 0) dirvalid |= 001;				/* X-1 is valid */
-			if(cell->y > 0) dirvalid |= 002;				/* Y-1 is valid */
-			if(cell->z > 0) dirvalid |= 004;				/* Z-1 is valid */
-			if(cell->x < vol->xres - 2) dirvalid |= 010;	/* X+1 is valid */
-			if(cell->y < vol->yres - 2) dirvalid |= 020;	/* Y+1 is valid */
-			if(cell->z < vol->zres - 2) dirvalid |= 040;	/* Z+1 is valid */
-
-			/* examine the current cell, if it's on the surface expand the search to
-			 * its neighbors, otherwise keep going towards the same direction if we
-			 * haven't hit the surface, ignore it if we have.
-			 */
-			if(msurf_proc_cell(vol, cell)) {
-				/* this is part of the surface, add all neighbors */
-				foundsurf = 1;
-				ADDOPEN(001, cell - 1);
-				ADDOPEN(010, cell + 1);
-				ADDOPEN(003, cell - vol->xstore - 1);
-				ADDOPEN(002, cell - vol->xstore);
-				ADDOPEN(012, cell - vol->xstore + 1);
-				ADDOPEN(021, cell + vol->xstore - 1);
-				ADDOPEN(020, cell + vol->xstore);
-				ADDOPEN(030, cell + vol->xstore + 1);
-				cellptr = cell - vol->xystore;
-				ADDOPEN(005, cellptr - 1);
-				ADDOPEN(004, cellptr);
-				ADDOPEN(014, cellptr + 1);
-				ADDOPEN(007, cellptr - vol->xstore - 1);
-				ADDOPEN(006, cellptr - vol->xstore);
-				ADDOPEN(016, cellptr - vol->xstore + 1);
-				ADDOPEN(025, cellptr + vol->xstore - 1);
-				ADDOPEN(024, cellptr + vol->xstore);
-				ADDOPEN(034, cellptr + vol->xstore + 1);
-				cellptr = cell + vol->xystore;
-				ADDOPEN(041, cellptr - 1);
-				ADDOPEN(040, cellptr);
-				ADDOPEN(050, cellptr + 1);
-				ADDOPEN(043, cellptr - vol->xstore - 1);
-				ADDOPEN(042, cellptr - vol->xstore);
-				ADDOPEN(052, cellptr - vol->xstore + 1);
-				ADDOPEN(061, cellptr + vol->xstore - 1);
-				ADDOPEN(060, cellptr + vol->xstore);
-				ADDOPEN(070, cellptr + vol->xstore + 1);
-			} else {
-				/* not part of the surface, if we haven't found the surface yet
-				 * expand along the Z axis, otherwise ignore
-				 */
-				if(!foundsurf) {
-					ADDOPEN(004, cell - vol->xystore);
-					ADDOPEN(040, cell + vol->xystore);
-				}
-			}
+	if((vol->flags & MSURF_QUANT16) && !vol->qval && vol->num_store) {
+		if(!(vol->qval = malloc(vol->num_store * sizeof *vol->qval))) {
+			fprintf(stderr, "failed to allocate quantized field values\n");
+			return -1;
 		}
 	}
 
-}
+	if(!(vol->flags & MSURF_VALID) || !(vol->flags & MSURF_POSVALID)) {
+		vol->dx = vol->size.x / vol->xres;
+		vol->dy = vol->size.y / vol->yres;
+		vol->dz = vol->size.z / vol->zres;
 
-static unsigned int next_pow2(unsigned int x)
-{
-	x--;
-	x |= x >> 1;
-	x |= x >> 2;
-	x |= x >> 4;
-	x |= x >> 8;
-	x |= x >> 16;
-	return x + 1;
-}
+		vol->flags |= MSURF_VALID | MSURF_POSVALID;
+		full_update = 1;
+	}
 
-static unsigned int calc_shift(unsigned int x)
-{
-	int res = -1;
-	while(x) {
-		x >>= 1;
-		++res;
+	/* anything affecting the field function everywhere invalidates the whole
+	 * volume, otherwise only the regions around metaballs which moved
+	 */
+	if(vol->falloff != vol->last_falloff || vol->falloff_rad != vol->last_falloff_rad ||
+			vol->cutoff != vol->last_cutoff || (vol->flags & FIELD_FLAGS) != vol->last_fflags ||
+			vol->floor_z != vol->last_floor_z || vol->floor_energy != vol->last_floor_energy ||
+			!(vol->flags & MSURF_STATICVALID)) {
+		vol->last_falloff = vol->falloff;
+		vol->last_falloff_rad = vol->falloff_rad;
+		vol->last_cutoff = vol->cutoff;
+		vol->last_fflags = vol->flags & FIELD_FLAGS;
+		vol->last_floor_z = vol->floor_z;
+		vol->last_floor_energy = vol->floor_energy;
+		full_update = 1;
 	}
-	return res;
+	if(full_update) {
+		for(i=0; i<vol->num_bricks; i++) {
+			dirty_brick(vol->bricks + i);
+		}
+	} else if(vol->isoval != vol->last_isoval) {
+		/* field values are still good, only cell codes need updating */
+		for(i=0; i<vol->num_bricks; i++) {
+			memset(vol->bricks[i].cvalid, 0, sizeof vol->bricks[i].cvalid);
+		}
+	}
+	vol->last_isoval = vol->isoval;
+
+	if(vol->num_mballs > vol->max_bstate) {
+		void *tmp;
+		if(!(tmp = realloc(vol->bstate, vol->num_mballs * sizeof *vol->bstate))) {
+			fprintf(stderr, "failed to allocate metaball state\n");
+			return -1;
+		}
+		vol->bstate = tmp;
+		vol->max_bstate = vol->num_mballs;
+	}
+	if(mfield_resize(&vol->field, vol->num_mballs) == -1) {
+		return -1;
+	}
+
+	/* balls which moved far enough invalidate their old and new support
+	 * regions, the rest are left where the cached field thinks they are.
+	 */
+	eps_sq = vol->dirty_eps * vol->dirty_eps;
+	for(i=0; i<vol->num_mballs; i++) {
+		struct msurf_metaball *mb = vol->mballs + i;
+		struct msurf_ballstate *bs = vol->bstate + i;
+
+		if(i >= vol->num_bstate || full_update || mb->energy != bs->energy ||
+				cgm_vdist_sq(&mb->pos, &bs->pos) > eps_sq) {
+			if(i < vol->num_bstate) {
+				dirty_sphere(vol, &bs->pos, bs->rad);
+			}
+			bs->pos = mb->pos;
+			bs->energy = mb->energy;
+			bs->dirty = 1;
+		}
+		vol->field.x[i] = bs->pos.x;
+		vol->field.y[i] = bs->pos.y;
+		vol->field.z[i] = bs->pos.z;
+		vol->field.energy[i] = bs->energy;
+	}
+	for(i=vol->num_mballs; i<vol->num_bstate; i++) {
+		dirty_sphere(vol, &vol->bstate[i].pos, vol->bstate[i].rad);
+	}
+	vol->num_bstate = vol->num_mballs;
+
+	mfield_kernel(&vol->field, vol->falloff, vol->falloff_rad, vol->cutoff);
+
+	/* everything which invalidates the whole volume also affects the static
+	 * layer, so that's when it gets re-baked
+	 */
+	if(full_update && init_static(vol) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<vol->num_mballs; i++) {
+		struct msurf_ballstate *bs = vol->bstate + i;
+		if(bs->dirty) {
+			bs->rad = vol->field.irad[i] > 0.0f ? 1.0f / sqrt(vol->field.irad[i]) : -1.0f;
+			dirty_sphere(vol, &bs->pos, bs->rad);
+			bs->dirty = 0;
+		}
+	}
+
+	if(sparse) {
+		for(i=0; i<3; i++) {
+			worg[i] = vol->worg[i];
+			wres[i] = vol->wres[i];
+		}
+		if(update_bricks(vol) == -1) {
+			return -1;
+		}
+		for(i=0; i<3; i++) {
+			if(vol->worg[i] != worg[i] || vol->wres[i] != wres[i]) {
+				new_tables = 1;
+			}
+		}
+	}
+	if((full_update || new_tables) && calc_tables(vol) == -1) {
+		return -1;
+	}
+
+	/* bake the static layer into every brick after a full update, and into
+	 * the ones just added to a sparse volume, which only become dirty now.
+	 * Then bound the field of everything that changed.
+	 */
+	for(i=0; i<vol->num_bricks; i++) {
+		brk = vol->bricks + i;
+		if(!brk->used) continue;
+		if(vol->base && (full_update || !brk->stamp)) {
+			bake_brick(vol, i);
+		}
+		if(!brk->stamp) {
+			dirty_brick(brk);
+		}
+		if(brk->stamp == frmid) {
+			bound_field(vol, brk);
+		}
+	}
+
+	if(vol->flags & MSURF_SEPARABLE) {
+		float org[3], step[3];
+		step[0] = vol->dx;
+		step[1] = vol->dy;
+		step[2] = vol->dz;
+		org[0] = vol->org.x + (float)vol->worg[0] * step[0];
+		org[1] = vol->org.y + (float)vol->worg[1] * step[1];
+		org[2] = vol->org.z + (float)vol->worg[2] * step[2];
+		if(mfield_axis_tables(&vol->field, org, step, vol->wres) == -1) {
+			return -1;
+		}
+	}
+
+	/* rebuild the metaball spatial index. Spans are evaluated against the
+	 * grid cell of their center voxel, so pad the cell lists by a span length.
+	 */
+	if(sparse) {
+		bmin[0] = vol->org.x + (float)vol->worg[0] * vol->dx;
+		bmin[1] = vol->org.y + (float)vol->worg[1] * vol->dy;
+		bmin[2] = vol->org.z + (float)vol->worg[2] * vol->dz;
+		bmax[0] = vol->org.x + (float)(vol->worg[0] + vol->wres[0]) * vol->dx;
+		bmax[1] = vol->org.y + (float)(vol->worg[1] + vol->wres[1]) * vol->dy;
+		bmax[2] = vol->org.z + (float)(vol->worg[2] + vol->wres[2]) * vol->dz;
+	} else {
+		bmin[0] = vol->org.x;
+		bmin[1] = vol->org.y;
+		bmin[2] = vol->org.z;
+		bmax[0] = vol->org.x + vol->size.x;
+		bmax[1] = vol->org.y + vol->size.y;
+		bmax[2] = vol->org.z + vol->size.z;
+	}
+	if(mfield_build_grid(&vol->field, bmin, bmax, EVAL_SPAN * vol->dx) == -1) {
+		return -1;
+	}
+
+	vol->num_verts = 0;
+	dbg_visited = 0;
+	dbg_evaluated = 0;
+	dbg_probes = 0;
+
+	if(vol->flags & MSURF_SPLAT) {
+		splat_field(vol);
+	}
+	return 0;
+}
+
+#ifdef __F16C__
+#define float_to_half(f)	_cvtss_sh(f, 0)
+#define half_to_float(h)	_cvtsh_ss(h)
+#else
+/* round to nearest even. Large values saturate to the largest half, and values
+ * too small for a normalized half are flushed to zero, neither matters around
+ * any sensible isovalue.
+ */
+static INLINE unsigned short float_to_half(float f)
+{
+	union { float f; unsigned int u; } v;
+	unsigned int sign, mant;
+	int exp;
+
+	v.f = f;
+	sign = (v.u >> 16) & 0x8000;
+	exp = (int)((v.u >> 23) & 0xff) - 112;
+	mant = v.u & 0x7fffff;
+
+	if(exp <= 0) return sign;
+	mant += 0xfff + ((mant >> 13) & 1);
+	if(mant & 0x800000) {
+		mant = 0;
+		exp++;
+	}
+	if(exp >= 31) return sign | 0x7bff;
+	return sign | (exp << 10) | (mant >> 13);
+}
+
+static INLINE float half_to_float(unsigned short h)
+{
+	union { float f; unsigned int u; } v;
+	unsigned int exp = (h >> 10) & 0x1f;
+
+	v.u = (h & 0x8000) << 16;
+	if(exp) {
+		v.u |= ((exp + 112) << 23) | ((h & 0x3ff) << 13);
+	}
+	return v.f;
+}
+#endif
+
+/* field values live in the voxels, or in the half float array in
+ * MSURF_QUANT16 mode. Interpolation is always done in float.
+ */
+static INLINE float voxel_val(struct msurf_volume *vol, struct msurf_voxel *vox)
+{
+	if(vol->flags & MSURF_QUANT16) {
+		return half_to_float(vol->qval[vox - vol->voxels]);
+	}
+	return vox->val;
+}
+
+static INLINE void set_voxel_val(struct msurf_volume *vol, struct msurf_voxel *vox, float val)
+{
+	if(vol->flags & MSURF_QUANT16) {
+		vol->qval[vox - vol->voxels] = float_to_half(val);
+	} else {
+		vox->val = val;
+	}
+}
+
+static INLINE float floor_field(struct msurf_volume *vol, float z)
+{
+	float dz;
+
+	if(vol->flags & MSURF_FLOOR) {
+		dz = z - vol->floor_z;
+		if(dz > 0) {
+			return vol->floor_energy / dz;
+		}
+	}
+	return 0.0f;
+}
+
+/* negated z derivative of the floor field */
+static INLINE float floor_grad(struct msurf_volume *vol, float z)
+{
+	float dz;
+
+	if(vol->flags & MSURF_FLOOR) {
+		dz = z - vol->floor_z;
+		if(dz > 0) {
+			return vol->floor_energy / (dz * dz);
+		}
+	}
+	return 0.0f;
+}
+
+/* scales an analytic gradient to the units of the finite differences, and
+ * normalizes it if necessary
+ */
+static INLINE void finish_grad(struct msurf_volume *vol, cgm_vec3 *grad)
+{
+	grad->x *= vol->dx;
+	grad->y *= vol->dy;
+	grad->z *= vol->dz;
+#ifdef NORMALIZE_GRAD
+	cgm_vnormalize(grad);
+#endif
+}
+
+/* value and raw gradient of the static field layer at voxel vox of slice z */
+static INLINE void static_field(struct msurf_volume *vol, struct msurf_voxel *vox,
+		int z, float *val, cgm_vec3 *grad)
+{
+	int addr;
+
+	z -= vol->worg[2];
+	*val = vol->floor_tab[z * 2];
+	if(grad) {
+		grad->x = grad->y = 0.0f;
+		grad->z = vol->floor_tab[z * 2 + 1];
+	}
+	if(vol->base) {
+		addr = vox - vol->voxels;
+		*val += vol->base[addr];
+		if(grad) {
+			cgm_vadd(grad, vol->base_grad + addr);
+		}
+	}
+}
+
+/* fills in the voxel position and floor field tables, for the voxels of the
+ * worg/wres window
+ */
+static int calc_tables(struct msurf_volume *vol)
+{
+	int i;
+	unsigned int size = vol->wres[0] + vol->wres[1] + vol->wres[2] * 3;
+	float *tmp;
+
+	if(size > vol->max_tab) {
+		if(!(tmp = realloc(vol->xpos, size * sizeof *vol->xpos))) {
+			fprintf(stderr, "failed to allocate voxel position tables\n");
+			return -1;
+		}
+		vol->xpos = tmp;
+		vol->max_tab = size;
+	}
+	vol->ypos = vol->xpos + vol->wres[0];
+	vol->zpos = vol->ypos + vol->wres[1];
+	vol->floor_tab = vol->zpos + vol->wres[2];
+
+	for(i=0; i<vol->wres[0]; i++) {
+		vol->xpos[i] = vol->org.x +
+			(float)(vol->worg[0] + i) * vol->size.x / (float)vol->xres;
+	}
+	for(i=0; i<vol->wres[1]; i++) {
+		vol->ypos[i] = vol->org.y +
+			(float)(vol->worg[1] + i) * vol->size.y / (float)vol->yres;
+	}
+	for(i=0; i<vol->wres[2]; i++) {
+		vol->zpos[i] = vol->org.z +
+			(float)(vol->worg[2] + i) * vol->size.z / (float)vol->zres;
+	}
+	for(i=0; i<vol->wres[2]; i++) {
+		vol->floor_tab[i * 2] = floor_field(vol, vol->zpos[i]);
+		vol->floor_tab[i * 2 + 1] = floor_grad(vol, vol->zpos[i]);
+	}
+	return 0;
+}
+
+/* sets up the static field layer. The floor field is tabulated per slice by
+ * calc_tables, and the static metaballs are kept in sfield, to be baked into
+ * each brick by bake_brick.
+ */
+static int init_static(struct msurf_volume *vol)
+{
+	unsigned int i, n;
+	struct msurf_metaball *mb;
+
+	vol->flags |= MSURF_STATICVALID;
+
+	if(!vol->num_static_mballs) {
+		free(vol->base);
+		free(vol->base_grad);
+		vol->base = 0;
+		vol->base_grad = 0;
+		return 0;
+	}
+
+	if(!vol->base) {
+		/* grow_bricks keeps them sized from now on */
+		n = vol->num_store ? vol->num_store : MSURF_BRICK_VOXELS;
+		vol->base = malloc(n * sizeof *vol->base);
+		vol->base_grad = malloc(n * sizeof *vol->base_grad);
+		if(!vol->base || !vol->base_grad) {
+			fprintf(stderr, "failed to allocate static field\n");
+			free(vol->base);
+			free(vol->base_grad);
+			vol->base = 0;
+			vol->base_grad = 0;
+			vol->flags &= ~MSURF_STATICVALID;
+			return -1;
+		}
+	}
+
+	if(mfield_resize(&vol->sfield, vol->num_static_mballs) == -1) {
+		vol->flags &= ~MSURF_STATICVALID;
+		return -1;
+	}
+	for(i=0; i<vol->num_static_mballs; i++) {
+		mb = vol->static_mballs + i;
+		vol->sfield.x[i] = mb->pos.x;
+		vol->sfield.y[i] = mb->pos.y;
+		vol->sfield.z[i] = mb->pos.z;
+		vol->sfield.energy[i] = mb->energy;
+	}
+	mfield_kernel(&vol->sfield, vol->falloff, vol->falloff_rad, vol->cutoff);
+	return 0;
+}
+
+/* bakes the field of the static metaballs into brick b, within their support
+ * radius. Balls are added in order, so it doesn't matter which bricks are
+ * baked together.
+ */
+static void bake_brick(struct msurf_volume *vol, int b)
+{
+	unsigned int i;
+	int j, n, x, y, z, x0, y0, z0, x1, y1, z1, addr;
+	float rad, ball[3], px[EVAL_SPAN], py[EVAL_SPAN], pz[EVAL_SPAN];
+	float val[EVAL_SPAN], grad[EVAL_SPAN * 3];
+	struct msurf_brick *brk = vol->bricks + b;
+	struct mfield *sf = &vol->sfield;
+
+	addr = b * MSURF_BRICK_VOXELS;
+	memset(vol->base + addr, 0, MSURF_BRICK_VOXELS * sizeof *vol->base);
+	memset(vol->base_grad + addr, 0, MSURF_BRICK_VOXELS * sizeof *vol->base_grad);
+
+	for(i=0; i<vol->num_static_mballs; i++) {
+		ball[0] = sf->x[i] - vol->org.x;
+		ball[1] = sf->y[i] - vol->org.y;
+		ball[2] = sf->z[i] - vol->org.z;
+
+		x0 = brk->x;
+		y0 = brk->y;
+		z0 = brk->z;
+		x1 = x0 + BRICK_MASK;
+		y1 = y0 + BRICK_MASK;
+		z1 = z0 + BRICK_MASK;
+		if(x1 >= vol->worg[0] + vol->wres[0]) x1 = vol->worg[0] + vol->wres[0] - 1;
+		if(y1 >= vol->worg[1] + vol->wres[1]) y1 = vol->worg[1] + vol->wres[1] - 1;
+		if(z1 >= vol->worg[2] + vol->wres[2]) z1 = vol->worg[2] + vol->wres[2] - 1;
+		if(sf->irad[i] > 0.0f) {
+			rad = 1.0f / sqrt(sf->irad[i]);
+			if((x = (int)floor((ball[0] - rad) / vol->dx) - 1) > x0) x0 = x;
+			if((y = (int)floor((ball[1] - rad) / vol->dy) - 1) > y0) y0 = y;
+			if((z = (int)floor((ball[2] - rad) / vol->dz) - 1) > z0) z0 = z;
+			if((x = (int)floor((ball[0] + rad) / vol->dx) + 1) < x1) x1 = x;
+			if((y = (int)floor((ball[1] + rad) / vol->dy) + 1) < y1) y1 = y;
+			if((z = (int)floor((ball[2] + rad) / vol->dz) + 1) < z1) z1 = z;
+		}
+
+		for(z=z0; z<=z1; z++) {
+			for(y=y0; y<=y1; y++) {
+				for(x=x0; x<=x1; x+=n) {
+					n = EVAL_SPAN - (x & (EVAL_SPAN - 1));
+					if(n > x1 - x + 1) n = x1 - x + 1;
+
+					addr = brick_addr(vol, brk, x, y, z);
+					for(j=0; j<n; j++) {
+						px[j] = vol->xpos[x - vol->worg[0] + j];
+						py[j] = vol->ypos[y - vol->worg[1]];
+						pz[j] = vol->zpos[z - vol->worg[2]];
+						val[j] = vol->base[addr + j];
+						grad[j] = vol->base_grad[addr + j].x;
+						grad[n + j] = vol->base_grad[addr + j].y;
+						grad[2 * n + j] = vol->base_grad[addr + j].z;
+					}
+					mfield_eval_ball(sf, i, px, py, pz, val, grad, n);
+					for(j=0; j<n; j++) {
+						vol->base[addr + j] = val[j];
+						cgm_vcons(vol->base_grad + addr + j, grad[j], grad[n + j], grad[2 * n + j]);
+					}
+				}
+			}
+		}
+	}
+}
+
+/* bounds the field over the voxels the cells of a brick touch. Each ball adds
+ * between its falloff at the farthest and at the nearest point of their box,
+ * and the floor is tabulated per slice anyway.
+ */
+static void bound_field(struct msurf_volume *vol, struct msurf_brick *brk)
+{
+	int i, j, k, c0[3], c1[3], num, nterms = 0, open = 0;
+	float lo, hi, lomag, himag, d, nsq, fsq, near, far, pos[3], bmin[3], bmax[3];
+	struct mfield *mf;
+
+	c0[0] = brk->x;
+	c0[1] = brk->y;
+	c0[2] = brk->z;
+	for(i=0; i<3; i++) {
+		if((c1[i] = c0[i] + BRICK_SIZE) >= vol->worg[i] + vol->wres[i]) {
+			c1[i] = vol->worg[i] + vol->wres[i] - 1;
+		}
+		c0[i] -= vol->worg[i];
+		c1[i] -= vol->worg[i];
+	}
+	bmin[0] = vol->xpos[c0[0]];
+	bmin[1] = vol->ypos[c0[1]];
+	bmin[2] = vol->zpos[c0[2]];
+	bmax[0] = vol->xpos[c1[0]];
+	bmax[1] = vol->ypos[c1[1]];
+	bmax[2] = vol->zpos[c1[2]];
+
+	lo = hi = vol->floor_tab[c0[2] * 2];
+	for(i=c0[2]+1; i<=c1[2]; i++) {
+		d = vol->floor_tab[i * 2];
+		if(d < lo) lo = d;
+		if(d > hi) hi = d;
+	}
+	lomag = fabs(lo);
+	himag = fabs(hi);
+
+	for(i=0; i<2; i++) {
+		mf = i ? &vol->sfield : &vol->field;
+		num = i ? vol->num_static_mballs : vol->num_mballs;
+		for(j=0; j<num; j++) {
+			pos[0] = mf->x[j];
+			pos[1] = mf->y[j];
+			pos[2] = mf->z[j];
+			nsq = fsq = 0.0f;
+			for(k=0; k<3; k++) {
+				if(pos[k] < bmin[k]) {
+					d = bmin[k] - pos[k];
+					nsq += d * d;
+				} else if(pos[k] > bmax[k]) {
+					d = pos[k] - bmax[k];
+					nsq += d * d;
+				}
+				d = pos[k] - bmin[k] > bmax[k] - pos[k] ? pos[k] - bmin[k] : bmax[k] - pos[k];
+				fsq += d * d;
+			}
+			/* the center of a ball in the box bounds nothing from above */
+			if(nsq <= 0.0f) open = 1;
+
+			nsq *= 1.0f - BOUND_NUDGE;
+			if(nsq * mf->irad[j] >= 1.0f) continue;
+			fsq *= 1.0f + BOUND_NUDGE;
+
+			near = mfield_falloff(mf, j, nsq);
+			far = mfield_falloff(mf, j, fsq);
+			if(near < far) {
+				d = near;
+				near = far;
+				far = d;
+			}
+			lo += far;
+			hi += near;
+			lomag += fabs(far);
+			himag += fabs(near);
+			nterms++;
+		}
+	}
+
+	brk->lo = lo - lomag * BOUND_EPS - nterms * BOUND_ULPS;
+	brk->hi = open ? FLT_MAX : hi + himag * BOUND_EPS + nterms * BOUND_ULPS;
+	brk->vmin = brk->lo;
+	brk->vmax = brk->hi;
+}
+
+/* support radius of a metaball for placing sparse bricks, < 0 if it has none.
+ * Balls with an infinite kernel still only matter down to the isovalue, shared
+ * between nterms contributions.
+ */
+static float ball_reach(struct msurf_volume *vol, struct mfield *mf, int i, int nterms)
+{
+	float rad = -1.0f, iso_rad;
+
+	if(mf->irad[i] > 0.0f) {
+		rad = 1.0f / sqrt(mf->irad[i]);
+	}
+	if(vol->falloff == MFIELD_INVSQ && vol->isoval > 0.0f && mf->energy[i] > 0.0f) {
+		/* the sum of n terms can't reach the isovalue where each is below 1/n of it */
+		iso_rad = sqrt(mf->energy[i] * (float)nterms / vol->isoval);
+		if(rad < 0.0f || iso_rad < rad) rad = iso_rad;
+	}
+	return rad;
+}
+
+/* allocates the missing bricks within rad of pos, padded by SPARSE_PAD voxels,
+ * and marks all of them as used this frame
+ */
+static int reach_bricks(struct msurf_volume *vol, float *pos, float rad)
+{
+	int i, b, bmin[3], bmax[3], bc[3];
+	float d, dsq, lo, hi, bsize[3], cell[3];
+
+	cell[0] = vol->dx;
+	cell[1] = vol->dy;
+	cell[2] = vol->dz;
+	for(i=0; i<3; i++) {
+		bsize[i] = cell[i] * BRICK_SIZE;
+		bmin[i] = (int)floor((pos[i] - rad) / cell[i]) - SPARSE_PAD;
+		bmax[i] = (int)floor((pos[i] + rad) / cell[i]) + SPARSE_PAD;
+		bmin[i] >>= MSURF_BRICK_SHIFT;
+		bmax[i] >>= MSURF_BRICK_SHIFT;
+	}
+	rad += SPARSE_PAD * cell[0];
+
+	for(bc[2]=bmin[2]; bc[2]<=bmax[2]; bc[2]++) {
+		for(bc[1]=bmin[1]; bc[1]<=bmax[1]; bc[1]++) {
+			for(bc[0]=bmin[0]; bc[0]<=bmax[0]; bc[0]++) {
+				/* skip the corners of the box the sphere doesn't reach */
+				dsq = 0.0f;
+				for(i=0; i<3; i++) {
+					lo = (float)bc[i] * bsize[i];
+					hi = lo + bsize[i];
+					d = pos[i] < lo ? lo - pos[i] : (pos[i] > hi ? pos[i] - hi : 0.0f);
+					dsq += d * d;
+				}
+				if(dsq > rad * rad) continue;
+
+				if((b = find_brick(vol, bc[0], bc[1], bc[2])) >= 0) {
+					vol->bricks[b].used = frmid;
+				} else if(alloc_brick(vol, bc[0], bc[1], bc[2]) == -1) {
+					return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/* MSURF_SPARSE: allocates bricks wherever the metaballs can reach, returns the
+ * ones they left more than sparse_keep frames ago to the free list, and moves
+ * the window to the box of the bricks left
+ */
+static int update_bricks(struct msurf_volume *vol)
+{
+	unsigned int i, j, keep;
+	int released = 0, wmin[3], wmax[3];
+	float rad, pos[3];
+	struct mfield *mf;
+	struct msurf_brick *brk;
+
+	for(i=0; i<2; i++) {
+		mf = i ? &vol->sfield : &vol->field;
+		for(j=0; j<(i ? vol->num_static_mballs : vol->num_mballs); j++) {
+			if((rad = ball_reach(vol, mf, j, vol->num_mballs + vol->num_static_mballs)) < 0.0f) {
+				fprintf(stderr, "msurf2: sparse volumes need a compact kernel, or a "
+						"positive isovalue\n");
+				return -1;
+			}
+			pos[0] = mf->x[j] - vol->org.x;
+			pos[1] = mf->y[j] - vol->org.y;
+			pos[2] = mf->z[j] - vol->org.z;
+			if(reach_bricks(vol, pos, rad) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	keep = vol->sparse_keep > 0 ? vol->sparse_keep : DEF_SPARSE_KEEP;
+	for(i=0; i<vol->num_bricks; i++) {
+		brk = vol->bricks + i;
+		if(brk->used && frmid - brk->used > keep) {
+			free_brick(vol, i);
+			released = 1;
+		}
+	}
+	if(released && rehash_bricks(vol, vol->num_live) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<3; i++) {
+		wmin[i] = wmax[i] = 0;
+	}
+	j = 0;
+	for(i=0; i<vol->num_bricks; i++) {
+		brk = vol->bricks + i;
+		if(!brk->used) continue;
+		if(!j++) {
+			wmin[0] = wmax[0] = brk->x;
+			wmin[1] = wmax[1] = brk->y;
+			wmin[2] = wmax[2] = brk->z;
+			continue;
+		}
+		if(brk->x < wmin[0]) wmin[0] = brk->x;
+		if(brk->y < wmin[1]) wmin[1] = brk->y;
+		if(brk->z < wmin[2]) wmin[2] = brk->z;
+		if(brk->x > wmax[0]) wmax[0] = brk->x;
+		if(brk->y > wmax[1]) wmax[1] = brk->y;
+		if(brk->z > wmax[2]) wmax[2] = brk->z;
+	}
+	for(i=0; i<3; i++) {
+		vol->worg[i] = wmin[i];
+		vol->wres[i] = j ? wmax[i] + BRICK_SIZE - wmin[i] : 0;
+	}
+	return 0;
+}
+
+/* MSURF_AUTOFIT: moves the volume over the box the metaballs can reach, plus
+ * FIT_SLACK around it. The volume is refitted when that box pokes out of it,
+ * or is fit_shrink times smaller along any axis. Each refit clears
+ * MSURF_POSVALID, which recalculates the whole field.
+ */
+static int fit_volume(struct msurf_volume *vol)
+{
+	unsigned int i, num, nterms;
+	int refit;
+	float rad, shrink, need, top, bmin[3], bmax[3], pos[3], org[3], size[3];
+	struct msurf_metaball *mb;
+	struct mfield *mf = &vol->field;
+
+	if(!(num = vol->num_mballs + vol->num_static_mballs)) {
+		return 0;
+	}
+
+	/* the field is filled in from bstate later on, borrow it to get the
+	 * kernel radii of all metaballs where they are now
+	 */
+	if(mfield_resize(mf, num) == -1) {
+		return -1;
+	}
+	for(i=0; i<num; i++) {
+		if(i < vol->num_mballs) {
+			mb = vol->mballs + i;
+		} else {
+			mb = vol->static_mballs + i - vol->num_mballs;
+		}
+		mf->x[i] = mb->pos.x;
+		mf->y[i] = mb->pos.y;
+		mf->z[i] = mb->pos.z;
+		mf->energy[i] = mb->energy;
+	}
+	mfield_kernel(mf, vol->falloff, vol->falloff_rad, vol->cutoff);
+
+	/* the floor adds to the field of the balls, and takes its share of the
+	 * isovalue in the INVSQ reach
+	 */
+	nterms = num;
+	if((vol->flags & MSURF_FLOOR) && vol->floor_energy > 0.0f) {
+		nterms++;
+	}
+
+	for(i=0; i<3; i++) {
+		bmin[i] = FLT_MAX;
+		bmax[i] = -FLT_MAX;
+	}
+	for(i=0; i<num; i++) {
+		if((rad = ball_reach(vol, mf, i, nterms)) < 0.0f) {
+			fprintf(stderr, "msurf2: auto-fit volumes need a compact kernel, or a "
+					"positive isovalue\n");
+			return -1;
+		}
+		pos[0] = mf->x[i];
+		pos[1] = mf->y[i];
+		pos[2] = mf->z[i];
+		if(pos[0] - rad < bmin[0]) bmin[0] = pos[0] - rad;
+		if(pos[1] - rad < bmin[1]) bmin[1] = pos[1] - rad;
+		if(pos[2] - rad < bmin[2]) bmin[2] = pos[2] - rad;
+		if(pos[0] + rad > bmax[0]) bmax[0] = pos[0] + rad;
+		if(pos[1] + rad > bmax[1]) bmax[1] = pos[1] + rad;
+		if(pos[2] + rad > bmax[2]) bmax[2] = pos[2] + rad;
+	}
+	/* the floor goes on forever, only its height counts: up to its own surface,
+	 * and with INVSQ up to where it drops below its share of the isovalue, as
+	 * the balls only reach as far as their shares above that
+	 */
+	if(vol->flags & MSURF_FLOOR) {
+		top = vol->floor_z;
+		if(vol->floor_energy > 0.0f && vol->isoval > 0.0f) {
+			top += vol->floor_energy / vol->isoval *
+				(vol->falloff == MFIELD_INVSQ ? (float)nterms : 1.0f);
+		}
+		if(vol->floor_z < bmin[2]) bmin[2] = vol->floor_z;
+		if(top > bmax[2]) bmax[2] = top;
+	}
+
+	org[0] = vol->org.x;
+	org[1] = vol->org.y;
+	org[2] = vol->org.z;
+	size[0] = vol->size.x;
+	size[1] = vol->size.y;
+	size[2] = vol->size.z;
+	shrink = vol->fit_shrink > 0.0f ? vol->fit_shrink : DEF_FIT_SHRINK;
+
+	/* fit from scratch when the flag was just set */
+	refit = !(vol->last_fflags & MSURF_AUTOFIT);
+	for(i=0; i<3; i++) {
+		if(bmax[i] <= bmin[i]) return 0;
+		if(bmin[i] < org[i] || bmax[i] > org[i] + size[i] ||
+				(bmax[i] - bmin[i]) * shrink < size[i]) {
+			refit = 1;
+		}
+	}
+	if(!refit) return 0;
+
+	for(i=0; i<3; i++) {
+		need = bmax[i] - bmin[i];
+		org[i] = bmin[i] - need * FIT_SLACK * 0.5f;
+		size[i] = need * (1.0f + FIT_SLACK);
+	}
+	cgm_vcons(&vol->org, org[0], org[1], org[2]);
+	msurf_size(vol, size[0], size[1], size[2]);
+	return 0;
+}
+
+/* Push evaluation: instead of each voxel pulling contributions from nearby
+ * balls when the traversal first touches it, reset every brick which changed
+ * this frame to the static field, and have each ball add itself to the voxels
+ * of those bricks within its support radius. Balls are added in the same
+ * order as the pull evaluators, so the results are identical. Bricks the field
+ * bounds put all on one side are left to them, in case anything needs their
+ * voxels later. In MSURF_QUANT16 mode the sums are accumulated in the float
+ * voxel values, and quantized once all balls are in.
+ */
+static void splat_field(struct msurf_volume *vol)
+{
+	unsigned int i;
+	int j, n, b, bx, x, y, z, x0, y0, z0, x1, y1, z1, xa, xb, bx0, bx1;
+	int wend[3];
+	float rad, radsq, dy, dz, dyzsq, xr, ball[3];
+	float px[BRICK_SIZE], py[BRICK_SIZE], pz[BRICK_SIZE], val[BRICK_SIZE];
+	float grad[BRICK_SIZE * 3], *gptr;
+	struct msurf_brick *brk;
+	struct msurf_voxel *vox;
+
+	/* with analytic gradients, they are splatted along with the values */
+	gptr = (vol->flags & MSURF_FDGRAD) ? 0 : grad;
+
+	for(i=0; i<3; i++) {
+		wend[i] = vol->worg[i] + vol->wres[i];
+	}
+
+	for(i=0; i<vol->num_bricks; i++) {
+		brk = vol->bricks + i;
+		if(brk->stamp != frmid || !brk->used || !STRADDLES(brk, vol->isoval)) continue;
+
+		x1 = brk->x + BRICK_SIZE;
+		y1 = brk->y + BRICK_SIZE;
+		z1 = brk->z + BRICK_SIZE;
+		if(x1 > wend[0]) x1 = wend[0];
+		if(y1 > wend[1]) y1 = wend[1];
+		if(z1 > wend[2]) z1 = wend[2];
+		for(z=brk->z; z<z1; z++) {
+			for(y=brk->y; y<y1; y++) {
+				vox = vol->voxels + brick_addr(vol, brk, brk->x, y, z);
+				for(x=brk->x; x<x1; x++) {
+					static_field(vol, vox, z, &vox->val, gptr ? &vox->grad : 0);
+					vox++;
+				}
+			}
+		}
+		/* valid once all balls are in, nothing reads them before */
+		memset(brk->valid, 0xff, sizeof brk->valid);
+	}
+
+	for(i=0; i<vol->num_mballs; i++) {
+		ball[0] = vol->field.x[i] - vol->org.x;
+		ball[1] = vol->field.y[i] - vol->org.y;
+		ball[2] = vol->field.z[i] - vol->org.z;
+		rad = vol->bstate[i].rad;
+
+		x0 = vol->worg[0];
+		y0 = vol->worg[1];
+		z0 = vol->worg[2];
+		x1 = wend[0] - 1;
+		y1 = wend[1] - 1;
+		z1 = wend[2] - 1;
+		radsq = -1.0f;
+		if(rad >= 0.0f) {
+			/* pad everything a bit, the kernel decides the exact support */
+			radsq = rad * rad * 1.001f;
+			if((x = (int)floor((ball[0] - rad) / vol->dx) - 1) > x0) x0 = x;
+			if((y = (int)floor((ball[1] - rad) / vol->dy) - 1) > y0) y0 = y;
+			if((z = (int)floor((ball[2] - rad) / vol->dz) - 1) > z0) z0 = z;
+			if((x = (int)floor((ball[0] + rad) / vol->dx) + 1) < x1) x1 = x;
+			if((y = (int)floor((ball[1] + rad) / vol->dy) + 1) < y1) y1 = y;
+			if((z = (int)floor((ball[2] + rad) / vol->dz) + 1) < z1) z1 = z;
+		}
+
+		for(z=z0; z<=z1; z++) {
+			dz = (float)z * vol->dz - ball[2];
+			for(y=y0; y<=y1; y++) {
+				xa = x0;
+				xb = x1;
+				if(radsq >= 0.0f) {
+					/* clip the row to the extent of the sphere */
+					dy = (float)y * vol->dy - ball[1];
+					dyzsq = dy * dy + dz * dz;
+					if(dyzsq > radsq) continue;
+					xr = sqrt(radsq - dyzsq);
+					if((xa = (int)floor((ball[0] - xr) / vol->dx) - 1) < x0) xa = x0;
+					if((xb = (int)floor((ball[0] + xr) / vol->dx) + 1) > x1) xb = x1;
+				}
+
+				bx0 = xa >> MSURF_BRICK_SHIFT;
+				bx1 = xb >> MSURF_BRICK_SHIFT;
+				for(bx=bx0; bx<=bx1; bx++) {
+					b = find_brick(vol, bx, y >> MSURF_BRICK_SHIFT, z >> MSURF_BRICK_SHIFT);
+					if(b < 0 || vol->bricks[b].stamp != frmid ||
+							!STRADDLES(vol->bricks + b, vol->isoval)) {
+						continue;
+					}
+
+					/* the part of the row inside this brick */
+					x = bx * BRICK_SIZE;
+					if(x < xa) x = xa;
+					n = (bx + 1) * BRICK_SIZE - x;
+					if(n > xb - x + 1) n = xb - x + 1;
+
+					vox = vol->voxels + brick_addr(vol, vol->bricks + b, x, y, z);
+					for(j=0; j<n; j++) {
+						px[j] = vol->xpos[x - vol->worg[0] + j];
+						py[j] = vol->ypos[y - vol->worg[1]];
+						pz[j] = vol->zpos[z - vol->worg[2]];
+						val[j] = vox[j].val;
+						if(gptr) {
+							grad[j] = vox[j].grad.x;
+							grad[n + j] = vox[j].grad.y;
+							grad[2 * n + j] = vox[j].grad.z;
+						}
+					}
+					mfield_eval_ball(&vol->field, i, px, py, pz, val, gptr, n);
+					for(j=0; j<n; j++) {
+						vox[j].val = val[j];
+						if(gptr) {
+							vox[j].grad.x = grad[j];
+							vox[j].grad.y = grad[n + j];
+							vox[j].grad.z = grad[2 * n + j];
+						}
+					}
+					dbg_evaluated += n;
+				}
+			}
+		}
+	}
+
+	if(!gptr && !(vol->flags & MSURF_QUANT16)) return;
+
+	/* all contributions are in, finish the changed bricks */
+	for(i=0; i<vol->num_bricks; i++) {
+		brk = vol->bricks + i;
+		if(brk->stamp != frmid || !brk->used || !STRADDLES(brk, vol->isoval)) continue;
+
+		x1 = brk->x + BRICK_SIZE;
+		y1 = brk->y + BRICK_SIZE;
+		z1 = brk->z + BRICK_SIZE;
+		if(x1 > wend[0]) x1 = wend[0];
+		if(y1 > wend[1]) y1 = wend[1];
+		if(z1 > wend[2]) z1 = wend[2];
+		for(z=brk->z; z<z1; z++) {
+			for(y=brk->y; y<y1; y++) {
+				vox = vol->voxels + brick_addr(vol, brk, brk->x, y, z);
+				for(x=brk->x; x<x1; x++) {
+					if(gptr) {
+						finish_grad(vol, &vox->grad);
+					}
+					set_voxel_val(vol, vox, vox->val);
+					vox++;
+				}
+			}
+		}
+	}
+}
+
+/* marks all bricks within rad of pos as changed this frame, padded by one
+ * voxel to cover gradients and cells which reach over the brick border
+ */
+static void dirty_sphere(struct msurf_volume *vol, cgm_vec3 *pos, float rad)
+{
+	unsigned int i;
+	int b, x, y, z, x0, y0, z0, x1, y1, z1;
+	float px, py, pz;
+	struct msurf_brick *brk;
+
+	if(rad < 0.0f) {
+		for(i=0; i<vol->num_bricks; i++) {
+			dirty_brick(vol->bricks + i);
+		}
+		return;
+	}
+
+	px = pos->x - vol->org.x;
+	py = pos->y - vol->org.y;
+	pz = pos->z - vol->org.z;
+	x0 = (int)floor((px - rad) / vol->dx) - 1;
+	y0 = (int)floor((py - rad) / vol->dy) - 1;
+	z0 = (int)floor((pz - rad) / vol->dz) - 1;
+	x1 = (int)floor((px + rad) / vol->dx) + 1;
+	y1 = (int)floor((py + rad) / vol->dy) + 1;
+	z1 = (int)floor((pz + rad) / vol->dz) + 1;
+	if(x0 < vol->worg[0]) x0 = vol->worg[0];
+	if(y0 < vol->worg[1]) y0 = vol->worg[1];
+	if(z0 < vol->worg[2]) z0 = vol->worg[2];
+	if(x1 >= vol->worg[0] + vol->wres[0]) x1 = vol->worg[0] + vol->wres[0] - 1;
+	if(y1 >= vol->worg[1] + vol->wres[1]) y1 = vol->worg[1] + vol->wres[1] - 1;
+	if(z1 >= vol->worg[2] + vol->wres[2]) z1 = vol->worg[2] + vol->wres[2] - 1;
+	if(x0 > x1 || y0 > y1 || z0 > z1) return;
+
+	for(z=z0>>MSURF_BRICK_SHIFT; z<=z1>>MSURF_BRICK_SHIFT; z++) {
+		for(y=y0>>MSURF_BRICK_SHIFT; y<=y1>>MSURF_BRICK_SHIFT; y++) {
+			for(x=x0>>MSURF_BRICK_SHIFT; x<=x1>>MSURF_BRICK_SHIFT; x++) {
+				if((b = find_brick(vol, x, y, z)) < 0) continue;
+				brk = vol->bricks + b;
+				if(brk->stamp != frmid) {
+					dirty_brick(brk);
+				}
+			}
+		}
+	}
+}
+
+/* drops everything cached in the brick, and marks it as changed this frame */
+static INLINE void dirty_brick(struct msurf_brick *brk)
+{
+	brk->stamp = frmid;
+	brk->rvalid = 0;
+	memset(brk->valid, 0, sizeof brk->valid);
+	memset(brk->gvalid, 0, sizeof brk->gvalid);
+	memset(brk->cvalid, 0, sizeof brk->cvalid);
+}
+
+/* makes sure the field value of voxel (x, y, z) of brick brk is up to date */
+static INLINE void update_voxel(struct msurf_volume *vol, struct worker *w,
+		struct msurf_brick *brk, int x, int y, int z)
+{
+	if(!BIT_TEST_SYNC(brk->valid, brick_bit(x, y, z))) {
+		eval_span(vol, w, brk, x, y, z);
+	}
+}
+
+/* finite difference gradient at voxel (x, y, z) of brick brk. Forward
+ * differences where the next voxel exists, backward ones at the far side of
+ * the window, or of a sparse brick without a neighbor.
+ */
+static void calc_grad(struct msurf_volume *vol, struct worker *w, struct msurf_brick *brk,
+		int x, int y, int z, cgm_vec3 *grad)
+{
+	int i, offs, c[3], n[3];
+	float val, d[3];
+	struct msurf_voxel *ptr = vol->voxels + brick_addr(vol, brk, x, y, z);
+
+	c[0] = x;
+	c[1] = y;
+	c[2] = z;
+	val = voxel_val(vol, ptr);
+	for(i=0; i<3; i++) {
+		n[0] = x;
+		n[1] = y;
+		n[2] = z;
+		if(c[i] < vol->worg[i] + vol->wres[i] - 1 && (offs = NEXT_OFFS(brk, i, c[i]))) {
+			n[i]++;
+		} else {
+			offs = PREV_OFFS(brk, i, c[i]);
+			n[i]--;
+		}
+		/* cached gradients outlive the frame, so the neighbors must be current */
+		update_voxel(vol, w, near_brick(vol, brk, n[0], n[1], n[2]), n[0], n[1], n[2]);
+		if(n[i] > c[i]) {
+			d[i] = val - voxel_val(vol, ptr + offs);
+		} else {
+			d[i] = voxel_val(vol, ptr + offs) - val;
+		}
+	}
+	cgm_vcons(grad, d[0], d[1], d[2]);
+#ifdef NORMALIZE_GRAD
+	cgm_vnormalize(grad);
+#endif
+}
+
+/* evaluates the field for the aligned span of EVAL_SPAN voxels along X, which
+ * contains voxel (x, y, z) of brick brk. Neighboring voxels are almost always
+ * needed soon by the surface-following traversal, and whole spans keep the SIMD
+ * lanes full.
+ */
+static void eval_span(struct msurf_volume *vol, struct worker *w, struct msurf_brick *brk,
+		int x, int y, int z)
+{
+	int i, n, x0;
+	float px[EVAL_SPAN], py[EVAL_SPAN], pz[EVAL_SPAN], val[EVAL_SPAN];
+	float grad[EVAL_SPAN * 3], *gptr;
+	unsigned int *bits;
+	cgm_vec3 g;
+	struct msurf_voxel *vox;
+
+	/* analytic gradients are summed in the same pass as the values */
+	gptr = (vol->flags & MSURF_FDGRAD) ? 0 : grad;
+
+	x0 = x & ~(EVAL_SPAN - 1);
+	n = vol->worg[0] + vol->wres[0] - x0;
+	if(n > EVAL_SPAN) n = EVAL_SPAN;
+
+	vox = vol->voxels + brick_addr(vol, brk, x0, y, z);
+	for(i=0; i<n; i++) {
+		px[i] = vol->xpos[x0 - vol->worg[0] + i];
+		py[i] = vol->ypos[y - vol->worg[1]];
+		pz[i] = vol->zpos[z - vol->worg[2]];
+		if(gptr) {
+			static_field(vol, vox + i, z, val + i, &g);
+			grad[i] = g.x;
+			grad[n + i] = g.y;
+			grad[2 * n + i] = g.z;
+		} else {
+			static_field(vol, vox + i, z, val + i, 0);
+		}
+	}
+
+	i = n >> 1;
+	if(vol->flags & MSURF_SEPARABLE) {
+		mfield_eval_row(&vol->field, px[i], py[i], pz[i], x0 - vol->worg[0],
+				y - vol->worg[1], z - vol->worg[2], val, gptr, n);
+	} else {
+		mfield_eval_near(&vol->field, px[i], py[i], pz[i], px, py, pz, val, gptr, n);
+	}
+
+	for(i=0; i<n; i++) {
+		set_voxel_val(vol, vox + i, val[i]);
+		if(gptr) {
+			cgm_vcons(&vox[i].grad, grad[i], grad[n + i], grad[2 * n + i]);
+			finish_grad(vol, &vox[i].grad);
+		}
+	}
+
+	/* spans never cross bricks or bitset words, so they're set in one go.
+	 * Another thread may have evaluated the same span meanwhile, but it wrote
+	 * the same values.
+	 */
+	bits = brk->valid;
+	i = brick_bit(x0, y, z);
+	OR_BITS(bits[i >> 5], ((1u << n) - 1) << (i & 31));
+	w->evaluated += n;
+}
+
+/* makes sure the field values of the corners of a cell are up to date. If the
+ * cell doesn't touch the far sides of its brick, all corners are in it.
+ */
+static INLINE void update_corners(struct msurf_volume *vol, struct worker *w,
+		struct cell *cell, struct msurf_brick *brk, int cbit)
+{
+	int i, x, y, z;
+
+	for(i=0; i<8; i++) {
+		if(cell->inbrick) {
+			if(BIT_TEST_SYNC(brk->valid, cbit + cellboffs[i])) continue;
+			update_voxel(vol, w, brk, cell->x + celloffs[i][0], cell->y + celloffs[i][1],
+					cell->z + celloffs[i][2]);
+		} else {
+			x = cell->x + celloffs[i][0];
+			y = cell->y + celloffs[i][1];
+			z = cell->z + celloffs[i][2];
+			update_voxel(vol, w, near_brick(vol, brk, x, y, z), x, y, z);
+		}
+	}
+}
+
+/* returns the marching cubes code of a cell. The cached code is reused if the
+ * field around the cell hasn't changed, otherwise the metaball field is
+ * updated where necessary and the code recalculated.
+ */
+static INLINE unsigned int cell_code(struct msurf_volume *vol, struct worker *w,
+		struct cell *cell)
+{
+	int i, cbit;
+	unsigned int code;
+	struct msurf_brick *brk;
+
+	brk = vol->bricks + cell->addr / MSURF_BRICK_VOXELS;
+	cbit = cell->addr & (MSURF_BRICK_VOXELS - 1);
+
+	/* no need to look at the voxels of a brick all on one side */
+	if(brk->lo > vol->isoval) return 0xff;
+	if(brk->hi <= vol->isoval) return 0;
+
+	if(BIT_TEST_SYNC(brk->cvalid, cbit)) {
+		return vol->codes[cell->addr];
+	}
+
+	update_corners(vol, w, cell, brk, cbit);
+
+	code = 0;
+	for(i=0; i<8; i++) {
+		if(voxel_val(vol, cell_corner(vol, cell, i)) > vol->isoval) {
+			code |= 1 << i;
+		}
+	}
+	vol->codes[cell->addr] = code;
+	BIT_SET_SYNC(brk->cvalid, cbit);
+	return code;
+}
+
+/* generates the triangles of a surface cell with marching cubes code into out,
+ * which has room for them. Returns the number of vertices written.
+ */
+static int polygonize(struct msurf_volume *vol, struct worker *w, struct cell *cell,
+		unsigned int code, struct msurf_vertex *out)
+{
+	int i, j, x, y, z, p0, p1;
+	float t, val[8], x0, y0, z0, x1, y1, z1;
+	struct msurf_vertex vert[12];
+	struct msurf_voxel *vox0, *vox1;
+	struct msurf_brick *brk, *gbrk;
+
+	static const int pidx[12][2] = {
+		{0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6},
+		{6, 7},	{7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}
+	};
+
+	brk = vol->bricks + cell->addr / MSURF_BRICK_VOXELS;
+
+	/* for each of the voxels, make sure we have valid gradients */
+	if(vol->flags & MSURF_FDGRAD) {
+		for(i=0; i<8; i++) {
+			x = cell->x + celloffs[i][0];
+			y = cell->y + celloffs[i][1];
+			z = cell->z + celloffs[i][2];
+			gbrk = near_brick(vol, brk, x, y, z);
+			j = brick_bit(x, y, z);
+			if(!BIT_TEST_SYNC(gbrk->gvalid, j)) {
+				calc_grad(vol, w, gbrk, x, y, z, &cell_corner(vol, cell, i)->grad);
+				BIT_SET_SYNC(gbrk->gvalid, j);
+			}
+		}
+	} else {
+		/* analytic gradients come with the field values */
+		update_corners(vol, w, cell, brk, cell->addr & (MSURF_BRICK_VOXELS - 1));
+	}
+
+	for(i=0; i<8; i++) {
+		val[i] = voxel_val(vol, cell_corner(vol, cell, i));
+	}
+
+	/* generate up to max 12 verts per cube. interpolate positions and normals for each one */
+	for(i=0; i<12; i++) {
+		if(mc_edge_table[code] & (1 << i)) {
+			p0 = pidx[i][0];
+			p1 = pidx[i][1];
+			vox0 = cell_corner(vol, cell, p0);
+			vox1 = cell_corner(vol, cell, p1);
+
+			x = cell->x - vol->worg[0];
+			y = cell->y - vol->worg[1];
+			z = cell->z - vol->worg[2];
+			x0 = vol->xpos[x + celloffs[p0][0]];
+			y0 = vol->ypos[y + celloffs[p0][1]];
+			z0 = vol->zpos[z + celloffs[p0][2]];
+			x1 = vol->xpos[x + celloffs[p1][0]];
+			y1 = vol->ypos[y + celloffs[p1][1]];
+			z1 = vol->zpos[z + celloffs[p1][2]];
+
+			t = (w->isoval - val[p0]) / (val[p1] - val[p0]);
+			vert[i].x = x0 + (x1 - x0) * t;
+			vert[i].y = y0 + (y1 - y0) * t;
+			vert[i].z = z0 + (z1 - z0) * t;
+			vert[i].nx = vox0->grad.x + (vox1->grad.x - vox0->grad.x) * t;
+			vert[i].ny = vox0->grad.y + (vox1->grad.y - vox0->grad.y) * t;
+			vert[i].nz = vox0->grad.z + (vox1->grad.z - vox0->grad.z) * t;
+#ifdef NORMALIZE_NORMAL
+			cgm_vnormalize((cgm_vec3*)&vert[i].nx);
+#endif
+		}
+	}
+
+	/* for each generated triangle, add its vertices to the vertex buffer */
+	for(i=0; mc_tri_table[code][i] != -1; i+=3) {
+		for(j=0; j<3; j++) {
+			*out++ = vert[mc_tri_table[code][i + (2 - j)]];
+		}
+	}
+	return i;
+}
+
+static int proc_cell(struct msurf_volume *vol, struct worker *w, struct cell *cell)
+{
+	unsigned int newsz, code = cell_code(vol, w, cell);
+	struct msurf_vertex *newv;
+
+	if(code == 0 || code == 0xff) return 0;
+
+	/* make room for all the triangles of the cell at once */
+	if(w->num_verts + mc_num_tris[code] * 3 > w->max_verts) {
+		newsz = w->max_verts ? w->max_verts * 2 : 32;
+		if(!(newv = realloc(w->varr, newsz * sizeof *w->varr))) {
+			fprintf(stderr, "msurf2: failed to resize vertex array\n");
+			abort();
+		}
+		w->varr = newv;
+		w->max_verts = newsz;
+	}
+
+	w->num_verts += polygonize(vol, w, cell, code, w->varr + w->num_verts);
+	return 1;
+}
+
+int msurf_proc_cell(struct msurf_volume *vol, int x, int y, int z)
+{
+	int res, addr;
+	struct cell cell;
+	struct worker w;
+
+	if((addr = voxel_addr(vol, x, y, z)) < 0) {
+		return 0;
+	}
+	init_cell(vol, &cell, addr, x, y, z);
+	if(!cell.offs) return 0;
+
+	memset(&w, 0, sizeof w);
+	w.isoval = vol->isoval;
+	w.varr = vol->varr;
+	w.num_verts = vol->num_verts;
+	w.max_verts = vol->max_verts;
+
+	res = proc_cell(vol, &w, &cell);
+
+	vol->varr = w.varr;
+	vol->num_verts = w.num_verts;
+	vol->max_verts = w.max_verts;
+	dbg_evaluated += w.evaluated;
+	return res;
+}
+
+/* lays out the levels of the min/max pyramid, returns the number of nodes */
+static int init_pyramid(struct msurf_volume *vol, struct msurf_traversal *trav)
+{
+	int i, n = 0;
+	int dim[3];
+
+	dim[0] = vol->bxres;
+	dim[1] = vol->byres;
+	dim[2] = vol->bzres;
+	trav->pyr_levels = 0;
+	while((dim[0] > 1 || dim[1] > 1 || dim[2] > 1) && trav->pyr_levels < PYR_MAX_LEVELS) {
+		for(i=0; i<3; i++) {
+			dim[i] = (dim[i] + 1) >> 1;
+			trav->pyr_dim[trav->pyr_levels][i] = dim[i];
+		}
+		trav->pyr_offs[trav->pyr_levels++] = n;
+		n += dim[0] * dim[1] * dim[2];
+	}
+	return n;
+}
+
+static int init_traversal(struct msurf_volume *vol, int num_workers)
+{
+	int i, newsz;
+	unsigned int n;
+	struct msurf_traversal *trav;
+	struct worker *w;
+	void *tmp;
+
+	if(!(trav = vol->trav)) {
+		if(!(trav = calloc(1, sizeof *trav))) {
+			fprintf(stderr, "msurf2: failed to allocate traversal state\n");
+			return -1;
+		}
+		newsz = init_pyramid(vol, trav);
+		if(!(trav->pyr = malloc((newsz ? newsz : 1) * sizeof *trav->pyr))) {
+			fprintf(stderr, "msurf2: failed to allocate traversal state\n");
+			free(trav);
+			return -1;
+		}
+#ifdef USE_THREADS
+		pthread_mutex_init(&trav->lock, 0);
+		pthread_cond_init(&trav->cond, 0);
+#endif
+		vol->trav = trav;
+	}
+
+	/* sparse volumes grow their brick pool as they go */
+	if(vol->max_bricks > trav->max_bricks) {
+		n = vol->max_bricks;
+		if(!(tmp = realloc(trav->pending, n * MSURF_BRICK_WORDS * sizeof *trav->pending))) {
+			goto err;
+		}
+		trav->pending = tmp;
+		memset(trav->pending + trav->max_bricks * MSURF_BRICK_WORDS, 0,
+				(n - trav->max_bricks) * MSURF_BRICK_WORDS * sizeof *trav->pending);
+		if(!(tmp = realloc(trav->queued, n * sizeof *trav->queued))) {
+			goto err;
+		}
+		trav->queued = tmp;
+		memset(trav->queued + trav->max_bricks, 0, (n - trav->max_bricks) * sizeof *trav->queued);
+		if(!(tmp = realloc(trav->sweep, n * sizeof *trav->sweep))) {
+			goto err;
+		}
+		trav->sweep = tmp;
+		if(!(tmp = realloc(trav->voffs, (n + 1) * sizeof *trav->voffs))) {
+			goto err;
+		}
+		trav->voffs = tmp;
+		trav->max_bricks = n;
+	}
+
+	if(num_workers > trav->max_workers) {
+#ifdef USE_THREADS
+		/* mutexes can't be moved, re-create them after the realloc */
+		for(i=0; i<trav->max_workers; i++) {
+			pthread_mutex_destroy(&trav->workers[i].lock);
+		}
+#endif
+		if(!(w = realloc(trav->workers, num_workers * sizeof *w))) {
+			fprintf(stderr, "msurf2: failed to allocate %d traversal workers\n", num_workers);
+			w = trav->workers;
+			num_workers = trav->max_workers;
+		} else {
+			for(i=trav->max_workers; i<num_workers; i++) {
+				memset(w + i, 0, sizeof *w);
+			}
+			trav->workers = w;
+			trav->max_workers = num_workers;
+		}
+#ifdef USE_THREADS
+		for(i=0; i<trav->max_workers; i++) {
+			w[i].vol = vol;
+			pthread_mutex_init(&w[i].lock, 0);
+		}
+#endif
+		if(num_workers < 1) return -1;
+	}
+	trav->num_workers = num_workers;
+	return 0;
+
+err:
+	fprintf(stderr, "msurf2: failed to allocate traversal state\n");
+	return -1;
+}
+
+/* the seeds of the traversal: the previous frame's surface cells, followed by
+ * num_seeds metaball and floor seeds to be added by the caller
+ */
+static int init_seeds(struct msurf_volume *vol, int num_seeds)
+{
+	int i, num_prev, newsz;
+	struct msurf_traversal *trav = vol->trav;
+	struct worker *w;
+	int *seeds;
+
+	num_prev = 0;
+	for(i=0; i<trav->max_workers; i++) {
+		num_prev += trav->workers[i].num_surf;
+	}
+	if(num_prev + num_seeds > trav->max_seeds) {
+		newsz = num_prev + num_seeds;
+		if(!(seeds = realloc(trav->seeds, newsz * sizeof *seeds))) {
+			fprintf(stderr, "msurf2: failed to allocate %d traversal seeds\n", newsz);
+			return -1;
+		}
+		trav->seeds = seeds;
+		trav->max_seeds = newsz;
+	}
+	if(num_seeds > trav->max_found) {
+		if(!(seeds = realloc(trav->seed_found, num_seeds * sizeof *seeds))) {
+			fprintf(stderr, "msurf2: failed to allocate %d traversal seeds\n", num_seeds);
+			return -1;
+		}
+		trav->seed_found = seeds;
+		trav->max_found = num_seeds;
+	}
+	memset(trav->seed_found, 0, num_seeds * sizeof *trav->seed_found);
+
+	/* the surface cells of the previous frame come first */
+	trav->num_prev = 0;
+	for(i=0; i<trav->max_workers; i++) {
+		w = trav->workers + i;
+		if(w->num_surf) {
+			memcpy(trav->seeds + trav->num_prev, w->surf, w->num_surf * sizeof *w->surf);
+			trav->num_prev += w->num_surf;
+			w->num_surf = 0;
+		}
+	}
+	trav->num_seeds = trav->num_prev;
+	trav->floor_seed = -1;
+	trav->next_seed = 0;
+	return 0;
+}
+
+static void free_traversal(struct msurf_traversal *trav)
+{
+	int i;
+
+	if(!trav) return;
+
+	for(i=0; i<trav->max_workers; i++) {
+		free(trav->workers[i].open);
+		free(trav->workers[i].varr);
+		free(trav->workers[i].surf);
+#ifdef USE_THREADS
+		free(trav->workers[i].pub);
+		pthread_mutex_destroy(&trav->workers[i].lock);
+#endif
+	}
+#ifdef USE_THREADS
+	pthread_mutex_destroy(&trav->lock);
+	pthread_cond_destroy(&trav->cond);
+#endif
+	free(trav->workers);
+	free(trav->seeds);
+	free(trav->seed_found);
+	free(trav->pending);
+	free(trav->queued);
+	free(trav->pyr);
+	free(trav->sweep);
+	free(trav->voffs);
+	free(trav);
+}
+
+static void grow_open(struct worker *w)
+{
+	int newsz;
+	struct open_cell *tmp;
+
+	/* reclaim the space of cells handed to other threads first */
+	if(w->bot > 0) {
+		memmove(w->open, w->open + w->bot, (w->top - w->bot) * sizeof *w->open);
+		w->top -= w->bot;
+		w->bot = 0;
+		if(w->top < w->max_open) return;
+	}
+
+	newsz = w->max_open ? w->max_open * 2 : 256;
+	if(!(tmp = realloc(w->open, newsz * sizeof *w->open))) {
+		fprintf(stderr, "msurf2: failed to resize open cell stack\n");
+		abort();
+	}
+	w->open = tmp;
+	w->max_open = newsz;
+}
+
+static INLINE void push_open(struct worker *w, int addr, int seed)
+{
+	if(w->top >= w->max_open) {
+		grow_open(w);
+	}
+	w->open[w->top].addr = addr;
+	w->open[w->top++].seed = seed;
+}
+
+static void push_surf(struct worker *w, int addr)
+{
+	int newsz;
+	int *tmp;
+
+	if(w->num_surf >= w->max_surf) {
+		newsz = w->max_surf ? w->max_surf * 2 : 256;
+		if(!(tmp = realloc(w->surf, newsz * sizeof *w->surf))) {
+			return;		/* it's just a hint for the next frame */
+		}
+		w->surf = tmp;
+		w->max_surf = newsz;
+	}
+	w->surf[w->num_surf++] = addr;
+}
+
+/* marks a cell as visited, returns 0 if it already was (or another thread
+ * got to it first)
+ */
+static INLINE int claim_cell(struct msurf_volume *vol, int addr)
+{
+	unsigned int *word = vol->visited + (addr >> 5);
+	unsigned int bit = 1u << (addr & 31);
+
+	if(*word & bit) return 0;
+#ifdef USE_THREADS
+	if(threaded) {
+		return !(__sync_fetch_and_or(word, bit) & bit);
+	}
+#endif
+	*word |= bit;
+	return 1;
+}
+
+/* marks a claimed cell pending in its brick, and queues the brick on this
+ * thread's open list unless it already is on one
+ */
+static INLINE void pend_cell(struct msurf_volume *vol, struct worker *w, int addr)
+{
+	int b = addr / MSURF_BRICK_VOXELS;
+	struct msurf_traversal *trav = vol->trav;
+
+	/* the pending bits of each brick follow its storage order */
+	BIT_SET_SYNC(trav->pending, addr);
+
+	if(trav->queued[b]) return;
+#ifdef USE_THREADS
+	if(threaded) {
+		if(!__sync_bool_compare_and_swap(trav->queued + b, 0, 1)) return;
+	} else
+#endif
+	trav->queued[b] = 1;
+	push_open(w, b, OPEN_BRICK);
+}
+
+/* cell along an axis containing voxel coordinate f, clamped to the window,
+ * keeping margin more cells after it
+ */
+static INLINE int pos_cell(float f, int org, int res, int margin)
+{
+	int c = (int)floor(f);
+
+	if(c > org + res - 2 - margin) c = org + res - 2 - margin;
+	if(c < org) c = org;
+	return c;
+}
+
+/* whether a point is inside the box the window spans */
+static INLINE int in_window(struct msurf_volume *vol, const cgm_vec3 *p)
+{
+	float x = p->x - vol->org.x, y = p->y - vol->org.y, z = p->z - vol->org.z;
+
+	if(!(vol->flags & MSURF_SPARSE)) {
+		return x >= 0.0f && y >= 0.0f && z >= 0.0f && x <= vol->size.x &&
+			y <= vol->size.y && z <= vol->size.z;
+	}
+	return x >= (float)vol->worg[0] * vol->dx && y >= (float)vol->worg[1] * vol->dy &&
+		z >= (float)vol->worg[2] * vol->dz &&
+		x <= (float)(vol->worg[0] + vol->wres[0] - 1) * vol->dx &&
+		y <= (float)(vol->worg[1] + vol->wres[1] - 1) * vol->dy &&
+		z <= (float)(vol->worg[2] + vol->wres[2] - 1) * vol->dz;
+}
+
+/* field value and raw negated gradient at an arbitrary point, for the seed
+ * search. The static metaballs are only known at the voxels, so their part is
+ * interpolated.
+ */
+static void probe_field(struct msurf_volume *vol, const cgm_vec3 *pos, float *val,
+		cgm_vec3 *grad)
+{
+	int i, x, y, z, addr;
+	float g[3], fx, fy, fz, wgt;
+
+	*val = floor_field(vol, pos->z);
+	g[0] = g[1] = 0.0f;
+	g[2] = floor_grad(vol, pos->z);
+
+	if(vol->base) {
+		fx = (pos->x - vol->org.x) / vol->dx;
+		fy = (pos->y - vol->org.y) / vol->dy;
+		fz = (pos->z - vol->org.z) / vol->dz;
+		x = pos_cell(fx, vol->worg[0], vol->wres[0], 0);
+		y = pos_cell(fy, vol->worg[1], vol->wres[1], 0);
+		z = pos_cell(fz, vol->worg[2], vol->wres[2], 0);
+		fx -= x;
+		fy -= y;
+		fz -= z;
+		for(i=0; i<8; i++) {
+			wgt = (celloffs[i][0] ? fx : 1.0f - fx) * (celloffs[i][1] ? fy : 1.0f - fy) *
+				(celloffs[i][2] ? fz : 1.0f - fz);
+			addr = voxel_addr(vol, x + celloffs[i][0], y + celloffs[i][1], z + celloffs[i][2]);
+			if(addr < 0) continue;
+			*val += vol->base[addr] * wgt;
+			g[0] += vol->base_grad[addr].x * wgt;
+			g[1] += vol->base_grad[addr].y * wgt;
+			g[2] += vol->base_grad[addr].z * wgt;
+		}
+	}
+
+	mfield_eval(&vol->field, &pos->x, &pos->y, &pos->z, val, g, 1);
+	cgm_vcons(grad, g[0], g[1], g[2]);
+}
+
+#define PROBE_MAX_STEPS		64
+
+/* searches for the surface around a metaball seed at pos, by marching
+ * downhill along the field gradient with Newton steps (clamped to half a cell
+ * to four cells), then bisecting the last step down to a quarter of a cell.
+ * Returns the cell where the surface was crossed, or -1 if the seed is outside
+ * the surface to begin with, or the march leaves the volume.
+ */
+static int probe_ray(struct msurf_volume *vol, struct worker *w, const cgm_vec3 *pos)
+{
+	int i, cx, cy, cz;
+	float val, len, step, cellsz;
+	cgm_vec3 p, prev, dir, grad;
+
+	cellsz = vol->dx;
+	if(vol->dy < cellsz) cellsz = vol->dy;
+	if(vol->dz < cellsz) cellsz = vol->dz;
+
+	p = *pos;
+	if(!in_window(vol, &p)) {
+		return -1;
+	}
+	probe_field(vol, &p, &val, &grad);
+	w->probes++;
+	if(val <= vol->isoval) return -1;
+
+	cgm_vcons(&dir, 0, 0, -1);
+	for(i=0; i<PROBE_MAX_STEPS; i++) {
+		/* the stored gradient is negated, so it already points downhill */
+		len = cgm_vlength(&grad);
+		step = 4.0f * cellsz;
+		if(len > 1e-6f) {
+			dir = grad;
+			cgm_vscale(&dir, 1.0f / len);
+			if((val - vol->isoval) / len < step) {
+				step = (val - vol->isoval) / len;
+			}
+		}
+		if(step < 0.5f * cellsz) step = 0.5f * cellsz;
+
+		prev = p;
+		cgm_vadd_scaled(&p, &dir, step);
+		if(!in_window(vol, &p)) {
+			return -1;
+		}
+		probe_field(vol, &p, &val, &grad);
+		w->probes++;
+		if(val <= vol->isoval) break;
+	}
+	if(i >= PROBE_MAX_STEPS) return -1;
+
+	/* the surface is between prev (inside) and p (outside) */
+	while(cgm_vdist_sq(&prev, &p) > 0.0625f * cellsz * cellsz) {
+		dir = prev;
+		cgm_vadd(&dir, &p);
+		cgm_vscale(&dir, 0.5f);
+		probe_field(vol, &dir, &val, &grad);
+		w->probes++;
+		if(val > vol->isoval) {
+			prev = dir;
+		} else {
+			p = dir;
+		}
+	}
+
+	cx = pos_cell((p.x - vol->org.x) * vol->xres / vol->size.x,
+			vol->worg[0], vol->wres[0], 0);
+	cy = pos_cell((p.y - vol->org.y) * vol->yres / vol->size.y,
+			vol->worg[1], vol->wres[1], 0);
+	cz = pos_cell((p.z - vol->org.z) * vol->zres / vol->size.z,
+			vol->worg[2], vol->wres[2], 0);
+	return voxel_addr(vol, cx, cy, cz);
+}
+
+/* takes the next unused seed and pushes its starting cell */
+static int start_seed(struct msurf_volume *vol, struct worker *w)
+{
+	int seed, addr, ball, cross;
+	unsigned int code;
+	struct cell cell;
+	struct msurf_traversal *trav = vol->trav;
+
+	for(;;) {
+#ifdef USE_THREADS
+		if(threaded) {
+			seed = __sync_fetch_and_add(&trav->next_seed, 1);
+		} else
+#endif
+		seed = trav->next_seed++;
+
+		if(seed >= trav->num_seeds) return 0;
+		addr = trav->seeds[seed];
+
+		if(seed < trav->num_prev) {
+			/* previous surface cell, ignore it if the surface moved away, or
+			 * its sparse brick went back to the pool
+			 */
+			if(vol->bricks[addr / MSURF_BRICK_VOXELS].used && claim_cell(vol, addr)) {
+				pend_cell(vol, w, addr);
+				if(w->top > w->bot) return 1;
+			}
+			continue;
+		}
+
+		/* metaball seeds only need to search if their part of the surface
+		 * wasn't already reached from the previous frame's cells. Probe for
+		 * the surface, and if the cell found is really on it, either it's
+		 * already claimed, or it's the seed.
+		 */
+		ball = seed - trav->num_prev;
+		if(seed != trav->floor_seed) {
+			if(ball < (int)vol->num_mballs) {
+				cross = probe_ray(vol, w, &vol->mballs[ball].pos);
+			} else {
+				cross = probe_ray(vol, w, &vol->static_mballs[ball - vol->num_mballs].pos);
+			}
+			if(cross >= 0) {
+				addr_cell(vol, &cell, cross);
+				code = cell.offs ? cell_code(vol, w, &cell) : 0;
+				if(code != 0 && code != 0xff) {
+					if(claim_cell(vol, cross)) {
+						push_open(w, cross, ball);
+						return 1;
+					}
+					continue;
+				}
+			}
+		}
+		if(addr >= 0 && claim_cell(vol, addr)) {
+			push_open(w, addr, ball);
+			return 1;
+		}
+	}
+}
+
+#ifdef USE_THREADS
+/* moves the older half of the private open cells to the public array */
+static void share_work(struct msurf_traversal *trav, struct worker *w)
+{
+	int n = (w->top - w->bot) / 2;
+	int newsz;
+	struct open_cell *tmp;
+
+	pthread_mutex_lock(&w->lock);
+	if(w->num_pub + n > w->max_pub) {
+		newsz = w->max_pub ? w->max_pub * 2 : 256;
+		while(newsz < w->num_pub + n) newsz *= 2;
+		if(!(tmp = realloc(w->pub, newsz * sizeof *w->pub))) {
+			pthread_mutex_unlock(&w->lock);
+			return;		/* just keep them */
+		}
+		w->pub = tmp;
+		w->max_pub = newsz;
+	}
+	memcpy(w->pub + w->num_pub, w->open + w->bot, n * sizeof *w->pub);
+	w->num_pub += n;
+	pthread_mutex_unlock(&w->lock);
+	w->bot += n;
+
+	pthread_mutex_lock(&trav->lock);
+	trav->num_pub += n;
+	pthread_cond_broadcast(&trav->cond);
+	pthread_mutex_unlock(&trav->lock);
+}
+
+/* takes back our own public cells, or steals half of another thread's */
+static int steal_work(struct msurf_traversal *trav, struct worker *w)
+{
+	int i, j, n;
+	struct worker *victim;
+
+	for(i=0; i<trav->num_workers; i++) {
+		victim = trav->workers + (w - trav->workers + i) % trav->num_workers;
+		if(!victim->num_pub) continue;
+
+		pthread_mutex_lock(&victim->lock);
+		n = victim == w ? victim->num_pub : (victim->num_pub + 1) / 2;
+		for(j=0; j<n; j++) {
+			victim->num_pub--;
+			push_open(w, victim->pub[victim->num_pub].addr, victim->pub[victim->num_pub].seed);
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if(n) {
+			pthread_mutex_lock(&trav->lock);
+			trav->num_pub -= n;
+			pthread_mutex_unlock(&trav->lock);
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif	/* USE_THREADS */
+
+/* called when the private open cells run out. Returns 0 when there's nothing
+ * left to do for any thread.
+ */
+static int find_work(struct msurf_volume *vol, struct worker *w)
+{
+#ifdef USE_THREADS
+	int done;
+	struct msurf_traversal *trav = vol->trav;
+#endif
+
+	w->bot = w->top = 0;
+
+	if(start_seed(vol, w)) return 1;
+#ifdef USE_THREADS
+	if(trav->num_workers <= 1) return 0;
+
+	for(;;) {
+		if(steal_work(trav, w)) return 1;
+
+		pthread_mutex_lock(&trav->lock);
+		if(!trav->num_pub && !trav->done) {
+			/* the last thread to go idle ends the traversal */
+			if(++trav->num_idle == trav->num_workers) {
+				trav->done = 1;
+				pthread_cond_broadcast(&trav->cond);
+			}
+			while(!trav->num_pub && !trav->done) {
+				pthread_cond_wait(&trav->cond, &trav->lock);
+			}
+			trav->num_idle--;
+		}
+		done = trav->done;
+		pthread_mutex_unlock(&trav->lock);
+		if(done) return 0;
+	}
+#else
+	return 0;
+#endif
+}
+
+/* position of the neighbor in direction dir relative to the cell */
+#define DIR_X(dir)	(((dir) >> 3 & 1) - ((dir) & 1))
+#define DIR_Y(dir)	(((dir) >> 4 & 1) - ((dir) >> 1 & 1))
+#define DIR_Z(dir)	(((dir) >> 5 & 1) - ((dir) >> 2 & 1))
+
+/* address of the cell offset by (x, y, z) from a cell, -1 if its brick
+ * doesn't exist
+ */
+static INLINE int cell_nbr(struct msurf_volume *vol, struct cell *cell, int x, int y, int z)
+{
+	int b;
+	struct msurf_brick *brk = vol->bricks + cell->addr / MSURF_BRICK_VOXELS;
+
+	x += cell->x;
+	y += cell->y;
+	z += cell->z;
+	b = brk->nbr[NBR((x - brk->x) >> MSURF_BRICK_SHIFT, (y - brk->y) >> MSURF_BRICK_SHIFT,
+			(z - brk->z) >> MSURF_BRICK_SHIFT)];
+	return b < 0 ? -1 : b * MSURF_BRICK_VOXELS + brick_bit(x, y, z);
+}
+
+/* address of the neighbor in direction dir, from the steps to the previous
+ * and next cell along each axis. Those only add up across brick edges and
+ * corners in a dense volume, sparse ones look diagonal neighbors up.
+ */
+#define DIR_STEP(n, axis, d)	((d) < 0 ? (n)[axis][0] : ((d) > 0 ? (n)[axis][1] : 0))
+#define DIR_ADDR(dir) \
+	(diag ? cell_nbr(vol, cell, DIR_X(dir), DIR_Y(dir), DIR_Z(dir)) : \
+	 cell->addr + DIR_STEP(nstep, 0, DIR_X(dir)) + DIR_STEP(nstep, 1, DIR_Y(dir)) + \
+	 DIR_STEP(nstep, 2, DIR_Z(dir)))
+
+/* neighbors of surface cells are marked pending in their bricks, cells of
+ * searching seeds go on the open list directly
+ */
+#define ADDOPEN(dir) \
+	do { \
+		int addr; \
+		if((dirvalid & dir) == dir && (addr = DIR_ADDR(dir)) >= 0 && claim_cell(vol, addr)) { \
+			pend_cell(vol, w, addr); \
+		} \
+	} while(0)
+
+#define ADDSEEK(dir, seed) \
+	do { \
+		int addr; \
+		if((dirvalid & dir) == dir && (addr = DIR_ADDR(dir)) >= 0 && claim_cell(vol, addr)) { \
+			push_open(w, addr, seed); \
+		} \
+	} while(0)
+
+/* examines a claimed cell. If it's on the surface, expand the search to its
+ * neighbors, otherwise keep going towards the same direction if its seed
+ * hasn't hit the surface, ignore it if it has.
+ */
+static void visit_cell(struct msurf_volume *vol, struct worker *w, struct cell *cell, int seed)
+{
+	int i, diag, nstep[3][2];
+	unsigned int dirvalid;
+	struct msurf_traversal *trav = vol->trav;
+	struct msurf_brick *brk = vol->bricks + cell->addr / MSURF_BRICK_VOXELS;
+
+	/* at the edge of a sparse volume, some corners might not exist */
+	if(!cell->offs) return;
+
+	w->visited++;
+
+	/* each bit is 1 if it has cells to the corresponding side, then in
+	 * ADDOPEN we test (dirvalid & dir) == dir, to make sure all required
+	 * direction bits are set before attempting to add the cell.
+	 * Bits [0,5] are [... | +Z +Y +X | -Z -Y -X] <- bit 0 is -X.
+	 */
+	dirvalid = 0;
+	if(cell->x > vol->worg[0]) dirvalid |= 001;						/* X-1 is valid */
+	if(cell->y > vol->worg[1]) dirvalid |= 002;						/* Y-1 is valid */
+	if(cell->z > vol->worg[2]) dirvalid |= 004;						/* Z-1 is valid */
+	if(cell->x < vol->worg[0] + vol->wres[0] - 2) dirvalid |= 010;	/* X+1 is valid */
+	if(cell->y < vol->worg[1] + vol->wres[1] - 2) dirvalid |= 020;	/* Y+1 is valid */
+	if(cell->z < vol->worg[2] + vol->wres[2] - 2) dirvalid |= 040;	/* Z+1 is valid */
+
+	nstep[0][0] = PREV_OFFS(brk, 0, cell->x);
+	nstep[0][1] = NEXT_OFFS(brk, 0, cell->x);
+	nstep[1][0] = PREV_OFFS(brk, 1, cell->y);
+	nstep[1][1] = NEXT_OFFS(brk, 1, cell->y);
+	nstep[2][0] = PREV_OFFS(brk, 2, cell->z);
+	nstep[2][1] = NEXT_OFFS(brk, 2, cell->z);
+
+	/* sparse volumes might have no neighbor brick that way, and cells on a
+	 * brick edge or corner look their diagonal neighbors up
+	 */
+	diag = 0;
+	if(vol->flags & MSURF_SPARSE) {
+		for(i=0; i<3; i++) {
+			if(!nstep[i][0]) dirvalid &= ~(001 << i);
+			if(!nstep[i][1]) dirvalid &= ~(010 << i);
+		}
+		diag = (((cell->x + 1) & BRICK_MASK) < 2) + (((cell->y + 1) & BRICK_MASK) < 2) +
+			(((cell->z + 1) & BRICK_MASK) < 2) >= 2;
+	}
+
+	if(proc_cell(vol, w, cell)) {
+		/* this is part of the surface, add all neighbors */
+		push_surf(w, cell->addr);
+		if(seed >= 0) {
+			trav->seed_found[seed] = 1;
+		}
+		ADDOPEN(001);
+		ADDOPEN(010);
+		ADDOPEN(003);
+		ADDOPEN(002);
+		ADDOPEN(012);
+		ADDOPEN(021);
+		ADDOPEN(020);
+		ADDOPEN(030);
+		ADDOPEN(005);
+		ADDOPEN(004);
+		ADDOPEN(014);
+		ADDOPEN(007);
+		ADDOPEN(006);
+		ADDOPEN(016);
+		ADDOPEN(025);
+		ADDOPEN(024);
+		ADDOPEN(034);
+		ADDOPEN(041);
+		ADDOPEN(040);
+		ADDOPEN(050);
+		ADDOPEN(043);
+		ADDOPEN(042);
+		ADDOPEN(052);
+		ADDOPEN(061);
+		ADDOPEN(060);
+		ADDOPEN(070);
+	} else if(seed >= 0 && !trav->seed_found[seed]) {
+		/* not part of the surface, expand along the Z axis */
+		ADDSEEK(004, seed);
+		ADDSEEK(040, seed);
+	}
+}
+
+/* processes the pending cells of brick b in storage order, including any
+ * added to it meanwhile, then takes it off the open list
+ */
+static void visit_brick(struct msurf_volume *vol, struct worker *w, int b)
+{
+	int i, j, x0, y0, z0, any;
+	unsigned int bits[MSURF_BRICK_WORDS], *pend;
+	struct cell cell;
+	struct msurf_traversal *trav = vol->trav;
+
+	pend = trav->pending + b * MSURF_BRICK_WORDS;
+	x0 = vol->bricks[b].x;
+	y0 = vol->bricks[b].y;
+	z0 = vol->bricks[b].z;
+
+	for(;;) {
+		any = 0;
+		for(i=0; i<MSURF_BRICK_WORDS; i++) {
+#ifdef USE_THREADS
+			if(threaded) {
+				bits[i] = pend[i] ? __sync_lock_test_and_set(pend + i, 0) : 0;
+			} else
+#endif
+			{
+				bits[i] = pend[i];
+				pend[i] = 0;
+			}
+			any |= bits[i];
+		}
+
+		if(!any) {
+#ifdef USE_THREADS
+			if(threaded) {
+				/* cells pended while we were releasing the brick didn't queue
+				 * it, so check again after releasing it
+				 */
+				__sync_fetch_and_and(trav->queued + b, 0);
+				for(i=0; i<MSURF_BRICK_WORDS; i++) {
+					if(pend[i]) break;
+				}
+				if(i < MSURF_BRICK_WORDS && __sync_bool_compare_and_swap(trav->queued + b, 0, 1)) {
+					continue;
+				}
+				return;
+			}
+#endif
+			trav->queued[b] = 0;
+			return;
+		}
+
+		for(i=0; i<MSURF_BRICK_WORDS; i++) {
+			while(bits[i]) {
+				j = (i << 5) | ctz(bits[i]);
+				bits[i] &= bits[i] - 1;
+				init_cell(vol, &cell, b * MSURF_BRICK_VOXELS + j, x0 + (j & BRICK_MASK),
+						y0 + (j >> MSURF_BRICK_SHIFT & BRICK_MASK),
+						z0 + (j >> (MSURF_BRICK_SHIFT * 2)));
+				visit_cell(vol, w, &cell, -1);
+			}
+		}
+	}
+}
+
+/* start from the center of each metaball and go outwards until we hit the
+ * isosurface, then follow it
+ */
+static void traverse(struct msurf_volume *vol, struct worker *w)
+{
+	struct open_cell oc;
+	struct cell cell;
+#ifdef USE_THREADS
+	struct msurf_traversal *trav = vol->trav;
+#endif
+
+	while(w->top > w->bot || find_work(vol, w)) {
+		oc = w->open[--w->top];
+		if(oc.seed == OPEN_BRICK) {
+			visit_brick(vol, w, oc.addr);
+		} else {
+			addr_cell(vol, &cell, oc.addr);
+			visit_cell(vol, w, &cell, oc.seed);
+		}
+
+#ifdef USE_THREADS
+		if(trav->num_idle && w->top - w->bot >= SHARE_MIN) {
+			share_work(trav, w);
+		}
+#endif
+	}
+}
+
+/* evaluates all voxels the cells of a brick touch, and updates its range */
+static void bound_brick(struct msurf_volume *vol, struct worker *w, int b)
+{
+	int n, x, y, z, x0, y0, z0, x1, y1, z1, xend, addr;
+	float val;
+	struct msurf_brick *brk, *rbrk;
+
+	brk = vol->bricks + b;
+	/* if the field bounds rule the isovalue out, they do as the range until
+	 * another isovalue needs the real one
+	 */
+	if(brk->rvalid || !brk->used || !STRADDLES(brk, w->isoval)) return;
+
+	x0 = brk->x;
+	y0 = brk->y;
+	z0 = brk->z;
+	if((x1 = x0 + BRICK_SIZE) >= vol->worg[0] + vol->wres[0]) x1 = vol->worg[0] + vol->wres[0] - 1;
+	if((y1 = y0 + BRICK_SIZE) >= vol->worg[1] + vol->wres[1]) y1 = vol->worg[1] + vol->wres[1] - 1;
+	if((z1 = z0 + BRICK_SIZE) >= vol->worg[2] + vol->wres[2]) z1 = vol->worg[2] + vol->wres[2] - 1;
+	xend = x1 < x0 + BRICK_MASK ? x1 : x0 + BRICK_MASK;
+
+	brk->vmin = FLT_MAX;
+	brk->vmax = -FLT_MAX;
+	for(z=z0; z<=z1; z++) {
+		for(y=y0; y<=y1; y++) {
+			/* the row of this brick or the next ones along Y and Z, missing
+			 * in sparse volumes if those don't exist
+			 */
+			n = brk->nbr[NBR(0, (y - y0) >> MSURF_BRICK_SHIFT, (z - z0) >> MSURF_BRICK_SHIFT)];
+			if(n < 0) continue;
+			rbrk = vol->bricks + n;
+
+			update_voxel(vol, w, rbrk, x0, y, z);
+			addr = brick_addr(vol, rbrk, x0, y, z);
+			for(x=x0; x<=xend; x++) {
+				val = voxel_val(vol, vol->voxels + addr++);
+				if(val < brk->vmin) brk->vmin = val;
+				if(val > brk->vmax) brk->vmax = val;
+			}
+
+			/* and the first voxel of the next one */
+			if(x1 > xend && (n = rbrk->nbr[NBR(1, 0, 0)]) >= 0) {
+				update_voxel(vol, w, vol->bricks + n, x1, y, z);
+				val = voxel_val(vol, vol->voxels + brick_addr(vol, vol->bricks + n, x1, y, z));
+				if(val < brk->vmin) brk->vmin = val;
+				if(val > brk->vmax) brk->vmax = val;
+			}
+		}
+	}
+	brk->rvalid = 1;
+}
+
+/* dense mode, first pass: slabs of bricks (one brick layer of a dense volume)
+ * are handed out to the threads, which make sure the ranges of all their
+ * bricks are current
+ */
+static void bound_slabs(struct msurf_volume *vol, struct worker *w)
+{
+	unsigned int b, end;
+	struct msurf_traversal *trav = vol->trav;
+
+	for(;;) {
+#ifdef USE_THREADS
+		if(threaded) {
+			b = __sync_fetch_and_add(&trav->next_slab, 1);
+		} else
+#endif
+		b = trav->next_slab++;
+
+		b *= trav->slab;
+		if(b >= vol->num_bricks) break;
+
+		if((end = b + trav->slab) > vol->num_bricks) end = vol->num_bricks;
+		for(; b<end; b++) {
+			bound_brick(vol, w, b);
+		}
+	}
+}
+
+/* rebuilds the levels of the min/max pyramid above the bricks */
+static void build_pyramid(struct msurf_volume *vol)
+{
+	int i, x, y, z, cx, cy, cz, lev, *cdim;
+	struct msurf_traversal *trav = vol->trav;
+	struct range *node, *child;
+	struct msurf_brick *brk;
+
+	for(lev=0; lev<trav->pyr_levels; lev++) {
+		cdim = lev ? trav->pyr_dim[lev - 1] : 0;
+		node = trav->pyr + trav->pyr_offs[lev];
+		for(z=0; z<trav->pyr_dim[lev][2]; z++) {
+			for(y=0; y<trav->pyr_dim[lev][1]; y++) {
+				for(x=0; x<trav->pyr_dim[lev][0]; x++) {
+					node->min = FLT_MAX;
+					node->max = -FLT_MAX;
+					for(i=0; i<8; i++) {
+						cx = x * 2 + (i & 1);
+						cy = y * 2 + (i >> 1 & 1);
+						cz = z * 2 + (i >> 2);
+						if(lev) {
+							if(cx >= cdim[0] || cy >= cdim[1] || cz >= cdim[2]) continue;
+							child = trav->pyr + trav->pyr_offs[lev - 1] +
+								(cz * cdim[1] + cy) * cdim[0] + cx;
+							if(child->min < node->min) node->min = child->min;
+							if(child->max > node->max) node->max = child->max;
+						} else {
+							if(cx >= (int)vol->bxres || cy >= (int)vol->byres ||
+									cz >= (int)vol->bzres) {
+								continue;
+							}
+							brk = vol->bricks + (cz * vol->byres + cy) * vol->bxres + cx;
+							if(brk->vmin < node->min) node->min = brk->vmin;
+							if(brk->vmax > node->max) node->max = brk->vmax;
+						}
+					}
+					node++;
+				}
+			}
+		}
+	}
+}
+
+/* walks down the pyramid from node (x, y, z) of level lev (-1 for the
+ * bricks), and lists the bricks which might contain the isovalue
+ */
+static void collect_bricks(struct msurf_volume *vol, int lev, int x, int y, int z)
+{
+	int i, cx, cy, cz, *cdim;
+	struct msurf_traversal *trav = vol->trav;
+	struct range *node;
+	struct msurf_brick *brk;
+
+	if(lev < 0) {
+		brk = vol->bricks + (z * vol->byres + y) * vol->bxres + x;
+		if(brk->vmin <= trav->isoval && brk->vmax > trav->isoval) {
+			trav->sweep[trav->num_sweep++] = brk - vol->bricks;
+		}
+		return;
+	}
+
+	node = trav->pyr + trav->pyr_offs[lev] + (z * trav->pyr_dim[lev][1] + y) *
+		trav->pyr_dim[lev][0] + x;
+	if(node->min > trav->isoval || node->max <= trav->isoval) return;
+
+	cdim = lev ? trav->pyr_dim[lev - 1] : 0;
+	for(i=0; i<8; i++) {
+		cx = x * 2 + (i & 1);
+		cy = y * 2 + (i >> 1 & 1);
+		cz = z * 2 + (i >> 2);
+		if(lev ? (cx >= cdim[0] || cy >= cdim[1] || cz >= cdim[2]) :
+				(cx >= (int)vol->bxres || cy >= (int)vol->byres || cz >= (int)vol->bzres)) {
+			continue;
+		}
+		collect_bricks(vol, lev - 1, cx, cy, cz);
+	}
+}
+
+#ifdef __SSE2__
+/* sign_span picks the values out of voxels loaded as 4 floats each, fails to
+ * compile if msurf_voxel changes layout
+ */
+typedef char voxel_layout_check[sizeof(struct msurf_voxel) == 4 * sizeof(float) &&
+	offsetof(struct msurf_voxel, val) == 0 ? 1 : -1];
+#endif
+
+/* sign bits (value above iso) of n <= BRICK_SIZE voxels of a row, from
+ * storage address addr on
+ */
+static INLINE unsigned int sign_span(struct msurf_volume *vol, int addr, int n, float iso)
+{
+	int i = 0;
+	unsigned int bits = 0;
+#ifdef __SSE2__
+	float *p;
+	__m128 viso = _mm_set1_ps(iso), v;
+
+	if(!(vol->flags & MSURF_QUANT16)) {
+		/* the values are the first lane of each voxel */
+		p = (float*)(vol->voxels + addr);
+		for(; i+4<=n; i+=4) {
+			v = _mm_movelh_ps(_mm_unpacklo_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 4)),
+					_mm_unpacklo_ps(_mm_loadu_ps(p + 8), _mm_loadu_ps(p + 12)));
+			bits |= (unsigned int)_mm_movemask_ps(_mm_cmpgt_ps(v, viso)) << i;
+			p += 16;
+		}
+	}
+#ifdef __F16C__
+	else {
+		for(; i+4<=n; i+=4) {
+			v = _mm_cvtph_ps(_mm_loadl_epi64((__m128i*)(vol->qval + addr + i)));
+			bits |= (unsigned int)_mm_movemask_ps(_mm_cmpgt_ps(v, viso)) << i;
+		}
+	}
+#endif
+#endif
+	for(; i<n; i++) {
+		if(voxel_val(vol, vol->voxels + addr + i) > iso) {
+			bits |= 1u << i;
+		}
+	}
+	return bits;
+}
+
+/* classifies the voxels the nx * ny * nz cells of a brick touch, into one
+ * word of sign bits per row along X. The voxels which don't exist, past the
+ * window or in missing bricks of sparse volumes, are left out of have.
+ */
+static void sign_rows(struct msurf_volume *vol, struct msurf_brick *brk, float iso,
+		int nx, int ny, int nz, unsigned int (*in)[BRICK_SIZE + 1],
+		unsigned int (*have)[BRICK_SIZE + 1])
+{
+	int n, y, z, len;
+	struct msurf_brick *rbrk;
+
+	len = nx < BRICK_SIZE ? nx + 1 : BRICK_SIZE;
+	for(z=0; z<=nz; z++) {
+		for(y=0; y<=ny; y++) {
+			in[z][y] = have[z][y] = 0;
+			n = brk->nbr[NBR(0, y >> MSURF_BRICK_SHIFT, z >> MSURF_BRICK_SHIFT)];
+			if(n < 0) continue;
+			rbrk = vol->bricks + n;
+
+			in[z][y] = sign_span(vol, brick_addr(vol, rbrk, brk->x, brk->y + y, brk->z + z),
+					len, iso);
+			have[z][y] = (1u << len) - 1;
+
+			if(nx == BRICK_SIZE && (n = rbrk->nbr[NBR(1, 0, 0)]) >= 0) {
+				rbrk = vol->bricks + n;
+				in[z][y] |= sign_span(vol, brick_addr(vol, rbrk, brk->x + BRICK_SIZE,
+							brk->y + y, brk->z + z), 1, iso) << BRICK_SIZE;
+				have[z][y] |= 1u << BRICK_SIZE;
+			}
+		}
+	}
+}
+
+/* dense mode, second and third pass: the listed bricks are handed out to the
+ * threads. With every voxel current, each is compared to the isovalue once,
+ * and the cells of a row are classified together from the sign bits of the
+ * four rows of voxels around them. Only the surface cells are visited one by
+ * one, to count their vertices, then to write them to the range of varr the
+ * brick was given.
+ */
+static void sweep(struct msurf_volume *vol, struct worker *w)
+{
+	int i, b, x, y, z, nx, ny, nz;
+	unsigned int code, r0, r1, r2, r3, all, any, surf, count;
+	unsigned int in[BRICK_SIZE + 1][BRICK_SIZE + 1], have[BRICK_SIZE + 1][BRICK_SIZE + 1];
+	struct cell cell;
+	struct msurf_vertex *out;
+	struct msurf_traversal *trav = vol->trav;
+	struct msurf_brick *brk;
+
+	for(;;) {
+#ifdef USE_THREADS
+		if(threaded) {
+			i = __sync_fetch_and_add(&trav->next_sweep, 1);
+		} else
+#endif
+		i = trav->next_sweep++;
+
+		if(i >= trav->num_sweep) break;
+		if(!trav->counting && trav->voffs[i] == trav->voffs[i + 1]) continue;
+		b = trav->sweep[i];
+
+		brk = vol->bricks + b;
+		if((nx = vol->worg[0] + vol->wres[0] - 1 - brk->x) > BRICK_SIZE) nx = BRICK_SIZE;
+		if((ny = vol->worg[1] + vol->wres[1] - 1 - brk->y) > BRICK_SIZE) ny = BRICK_SIZE;
+		if((nz = vol->worg[2] + vol->wres[2] - 1 - brk->z) > BRICK_SIZE) nz = BRICK_SIZE;
+		if(nx <= 0 || ny <= 0 || nz <= 0) {
+			trav->voffs[i] = 0;
+			continue;
+		}
+
+		sign_rows(vol, brk, w->isoval, nx, ny, nz, in, have);
+
+		count = 0;
+		out = vol->varr + trav->voffs[i];
+		for(z=0; z<nz; z++) {
+			for(y=0; y<ny; y++) {
+				if(trav->counting) {
+					w->visited += nx;
+				}
+
+				r0 = in[z][y];
+				r1 = in[z][y + 1];
+				r2 = in[z + 1][y];
+				r3 = in[z + 1][y + 1];
+
+				/* bit x of each mask stands for cell x, which has all corners
+				 * inside, any of them inside, or all of them in the volume
+				 */
+				all = r0 & r1 & r2 & r3;
+				all &= all >> 1;
+				any = r0 | r1 | r2 | r3;
+				any |= any >> 1;
+				surf = have[z][y] & have[z][y + 1] & have[z + 1][y] & have[z + 1][y + 1];
+				surf &= surf >> 1;
+				surf &= any & ~all & ((1u << nx) - 1);
+
+				while(surf) {
+					x = ctz(surf);
+					surf &= surf - 1;
+
+					code = ((r0 >> x) & 3) | (((r1 >> x) & 2) << 1) | (((r1 >> x) & 1) << 3) |
+						(((r2 >> x) & 3) << 4) | (((r3 >> x) & 2) << 5) | (((r3 >> x) & 1) << 7);
+					if(trav->counting) {
+						count += mc_num_tris[code] * 3;
+						continue;
+					}
+
+					init_cell(vol, &cell, brick_addr(vol, brk, brk->x + x, brk->y + y,
+								brk->z + z), brk->x + x, brk->y + y, brk->z + z);
+					out += polygonize(vol, w, &cell, code, out);
+					if(!trav->extract) {
+						push_surf(w, cell.addr);
+					}
+				}
+			}
+		}
+		if(trav->counting) {
+			trav->voffs[i] = count;
+		}
+	}
+}
+
+static void run_worker(struct msurf_volume *vol, struct worker *w)
+{
+	if(!vol->trav->dense) {
+		traverse(vol, w);
+	} else if(vol->trav->bounding) {
+		bound_slabs(vol, w);
+	} else {
+		sweep(vol, w);
+	}
+}
+
+#ifdef USE_THREADS
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	run_worker(w->vol, w);
+	return 0;
+}
+#endif
+
+/* runs the workers, the first one on the calling thread, and appends the
+ * vertices they generated to varr
+ */
+static void run_workers(struct msurf_volume *vol)
+{
+	int i;
+	unsigned int nverts;
+	struct msurf_traversal *trav = vol->trav;
+	struct msurf_vertex *varr;
+	struct worker *w = trav->workers;
+
+	for(i=0; i<trav->num_workers; i++) {
+		w[i].bot = w[i].top = 0;
+		w[i].num_verts = 0;
+		w[i].visited = w[i].evaluated = w[i].probes = 0;
+		w[i].isoval = trav->isoval;
+	}
+#ifdef USE_THREADS
+	trav->num_idle = 0;
+	trav->num_pub = 0;
+	trav->done = 0;
+#endif
+
+	/* the first worker appends to varr directly */
+	w->varr = vol->varr;
+	w->num_verts = vol->num_verts;
+	w->max_verts = vol->max_verts;
+
+#ifdef USE_THREADS
+	threaded = trav->num_workers > 1;
+	for(i=1; i<trav->num_workers; i++) {
+		if(pthread_create(&w[i].thread, 0, worker_main, w + i) != 0) {
+			fprintf(stderr, "msurf2: failed to start traversal thread\n");
+			/* whoever is running already will cover for the rest */
+			pthread_mutex_lock(&trav->lock);
+			trav->num_workers = i;
+			pthread_mutex_unlock(&trav->lock);
+			break;
+		}
+	}
+	run_worker(vol, w);
+	for(i=1; i<trav->num_workers; i++) {
+		pthread_join(w[i].thread, 0);
+	}
+	threaded = 0;
+#else
+	run_worker(vol, w);
+#endif
+
+	vol->varr = w->varr;
+	vol->max_verts = w->max_verts;
+	w->varr = 0;
+	w->max_verts = 0;
+
+	/* gather the vertices generated by the other threads */
+	nverts = w->num_verts;
+	for(i=1; i<trav->num_workers; i++) {
+		nverts += w[i].num_verts;
+	}
+	if(nverts > vol->max_verts) {
+		if(!(varr = realloc(vol->varr, nverts * sizeof *varr))) {
+			fprintf(stderr, "msurf2: failed to resize vertex array\n");
+			abort();
+		}
+		vol->varr = varr;
+		vol->max_verts = nverts;
+	}
+	vol->num_verts = w->num_verts;
+	for(i=0; i<trav->num_workers; i++) {
+		if(i > 0 && w[i].num_verts) {
+			memcpy(vol->varr + vol->num_verts, w[i].varr, w[i].num_verts * sizeof *varr);
+			vol->num_verts += w[i].num_verts;
+		}
+		dbg_visited += w[i].visited;
+		dbg_evaluated += w[i].evaluated;
+		dbg_probes += w[i].probes;
+	}
+}
+
+/* dense extraction: bring the ranges of the bricks the field bounds can't
+ * rule out up to date, then sweep the bricks the pyramid can't rule out, to
+ * count their vertices and then to write them
+ */
+static void run_dense(struct msurf_volume *vol)
+{
+	unsigned int i, n, count;
+	struct msurf_vertex *varr;
+	struct msurf_traversal *trav = vol->trav;
+	struct msurf_brick *brk;
+
+	for(i=0; i<vol->num_bricks; i++) {
+		brk = vol->bricks + i;
+		if(brk->used && !brk->rvalid && STRADDLES(brk, trav->isoval)) break;
+	}
+	if(i < vol->num_bricks) {
+		trav->bounding = 1;
+		trav->slab = (vol->flags & MSURF_SPARSE) ? SPARSE_SLAB : vol->bxres * vol->byres;
+		trav->next_slab = 0;
+		run_workers(vol);
+		trav->bounding = 0;
+	}
+
+	trav->num_sweep = 0;
+	trav->next_sweep = 0;
+	if(vol->flags & MSURF_SPARSE) {
+		/* no pyramid over a sparse volume, check the live bricks one by one */
+		for(i=0; i<vol->num_bricks; i++) {
+			brk = vol->bricks + i;
+			if(brk->used && brk->vmin <= trav->isoval && brk->vmax > trav->isoval) {
+				trav->sweep[trav->num_sweep++] = i;
+			}
+		}
+	} else if(trav->pyr_levels) {
+		build_pyramid(vol);
+		collect_bricks(vol, trav->pyr_levels - 1, 0, 0, 0);
+	} else {
+		collect_bricks(vol, -1, 0, 0, 0);
+	}
+
+	trav->counting = 1;
+	run_workers(vol);
+	trav->counting = 0;
+
+	/* exclusive prefix sum of the counts, then every brick writes its own
+	 * range of the exactly sized vertex array, in sweep order
+	 */
+	n = vol->num_verts;
+	for(i=0; i<(unsigned int)trav->num_sweep; i++) {
+		count = trav->voffs[i];
+		trav->voffs[i] = n;
+		n += count;
+	}
+	trav->voffs[trav->num_sweep] = n;
+	if(n > vol->max_verts) {
+		if(!(varr = realloc(vol->varr, n * sizeof *varr))) {
+			fprintf(stderr, "msurf2: failed to resize vertex array\n");
+			abort();
+		}
+		vol->varr = varr;
+		vol->max_verts = n;
+	}
+
+	trav->next_sweep = 0;
+	run_workers(vol);
+	vol->num_verts = n;
+}
+
+static int num_workers(struct msurf_volume *vol)
+{
+#ifdef USE_THREADS
+	return vol->num_threads > 1 ? vol->num_threads : 1;
+#else
+	return 1;
+#endif
+}
+
+void msurf_genmesh(struct msurf_volume *vol)
+{
+	unsigned int i, num_msurf;
+	int cx, cy, cz;
+	float ratio, cells;
+	cgm_vec3 *pos;
+	struct msurf_traversal *trav;
+
+	num_msurf = vol->num_mballs + vol->num_static_mballs;
+	if(vol->flags & MSURF_FLOOR) {
+		num_msurf++;
+	}
+	if(init_traversal(vol, num_workers(vol)) == -1 || init_seeds(vol, num_msurf) == -1) {
+		return;
+	}
+	trav = vol->trav;
+	trav->isoval = vol->isoval;
+	trav->extract = 0;
+
+	/* sweep the whole volume when the surface crosses a large part of it, and
+	 * following it costs more than streaming through every cell.
+	 */
+	trav->dense = vol->flags & MSURF_DENSE;
+	if(!trav->dense && (vol->flags & MSURF_AUTODENSE)) {
+		ratio = vol->dense_ratio > 0.0f ? vol->dense_ratio : DEF_DENSE_RATIO;
+		if(vol->flags & MSURF_SPARSE) {
+			cells = (float)vol->num_live * MSURF_BRICK_VOXELS;
+		} else {
+			cells = (float)(vol->xres - 1) * (vol->yres - 1) * (vol->zres - 1);
+		}
+		trav->dense = trav->num_prev > ratio * cells;
+	}
+	if(trav->dense) {
+		run_dense(vol);
+		return;
+	}
+
+	/* one bit per cell, set when it's added to an open list */
+	memset(vol->visited, 0, ((vol->num_store + 31) >> 5) * sizeof *vol->visited);
+
+	for(i=0; i<num_msurf; i++) {
+		if(i >= vol->num_mballs + vol->num_static_mballs) {
+			/* start from z=floor_z and go upwards until we meet the floor. A
+			 * sparse volume only has floor under the metaballs, start under
+			 * the first one.
+			 */
+			cz = (float)((vol->floor_z - vol->org.z) * vol->zres / vol->size.z) - 1;
+			if(cz >= vol->worg[2] + vol->wres[2] - 2) continue;
+			if(cz < vol->worg[2]) cz = vol->worg[2];
+			cx = vol->worg[0];
+			cy = vol->worg[1];
+			if((vol->flags & MSURF_SPARSE) && vol->num_mballs) {
+				pos = &vol->mballs[0].pos;
+				cx = pos_cell((pos->x - vol->org.x) * vol->xres / vol->size.x,
+						vol->worg[0], vol->wres[0], 0);
+				cy = pos_cell((pos->y - vol->org.y) * vol->yres / vol->size.y,
+						vol->worg[1], vol->wres[1], 0);
+			}
+			trav->floor_seed = trav->num_seeds;
+			trav->seeds[trav->num_seeds++] = voxel_addr(vol, cx, cy, cz);
+		} else {
+			/* start from the center of the ball */
+			if(i < vol->num_mballs) {
+				pos = &vol->mballs[i].pos;
+			} else {
+				pos = &vol->static_mballs[i - vol->num_mballs].pos;
+			}
+			cx = pos_cell((pos->x - vol->org.x) * vol->xres / vol->size.x,
+					vol->worg[0], vol->wres[0], 1);
+			cy = pos_cell((pos->y - vol->org.y) * vol->yres / vol->size.y,
+					vol->worg[1], vol->wres[1], 1);
+			cz = pos_cell((pos->z - vol->org.z) * vol->zres / vol->size.z,
+					vol->worg[2], vol->wres[2], 1);
+			trav->seeds[trav->num_seeds++] = voxel_addr(vol, cx, cy, cz);
+		}
+	}
+
+	run_workers(vol);
+}
+
+void msurf_extract(struct msurf_volume *vol, float isoval)
+{
+	struct msurf_traversal *trav;
+
+	if(init_traversal(vol, num_workers(vol)) == -1) {
+		return;
+	}
+	trav = vol->trav;
+	trav->isoval = isoval;
+	trav->extract = 1;
+	trav->dense = 1;
+	run_dense(vol);
 }
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MSURF2_H_
 
 #include "cgmath/cgmath.h"
+#include "mfield.h"
 
 #define INLINE	__inline
 
@@ -26,24 +27,76 @@ enum {
 	MSURF_VALID		= 0x100,
 	MSURF_POSVALID	= 0x200,
 	MSURF_GRADVALID	= 0x400,
-	MSURF_FLOOR		= 0x800
+	MSURF_FLOOR		= 0x800,
+	MSURF_SEPARABLE	= 0x1000,	/* evaluate rows from per-axis distance tables */
+	MSURF_SPLAT		= 0x2000,	/* push each ball into the voxels it reaches */
+	MSURF_FDGRAD	= 0x4000,	/* finite difference gradients instead of analytic */
+	MSURF_QUANT16	= 0x8000,	/* store field values as half floats in qval */
+	MSURF_STATICVALID	= 0x10000,	/* static field layer is up to date */
+	MSURF_DENSE		= 0x20000,	/* sweep every cell instead of following the surface */
+	MSURF_AUTODENSE	= 0x40000,	/* sweep when the last surface covered enough cells */
+	MSURF_SPARSE	= 0x80000,	/* unbounded, bricks allocated around the metaballs */
+	MSURF_AUTOFIT	= 0x100000	/* move and resize the volume to fit the metaballs */
 };
 
 struct msurf_volume;
+struct msurf_traversal;
 
+/* voxel positions aren't stored, see xpos/ypos/zpos in msurf_volume */
 struct msurf_voxel {
 	float val;
-	cgm_vec3 pos;
 	cgm_vec3 grad;
-	unsigned int flags;
 };
 
-struct msurf_cell {
-	struct msurf_volume *vol;
-	unsigned int x, y, z;
-	struct msurf_voxel *vox[8];
-	unsigned int flags;
-	struct msurf_cell *next;
+/* the volume is split into bricks of 2^MSURF_BRICK_SHIFT voxels per side, to
+ * track which parts of the field changed since the previous frame. Each brick
+ * keeps one bit per voxel (or per cell starting in it) for each kind of cached
+ * state, and all of them are cleared when the field in the brick changes.
+ * Voxels and cells are stored brick by brick too, in the same order as the
+ * bits, so most cells have all their corners in the same brick.
+ */
+#define MSURF_BRICK_SHIFT	3
+#define MSURF_BRICK_MASK	((1 << MSURF_BRICK_SHIFT) - 1)
+#define MSURF_BRICK_VOXELS	(1 << (MSURF_BRICK_SHIFT * 3))
+#define MSURF_BRICK_WORDS	(MSURF_BRICK_VOXELS / 32)
+
+struct msurf_brick {
+	unsigned int stamp;		/* frame the field in this brick last changed */
+	/* range of field values over the voxels the cells of this brick touch,
+	 * including the first layer of the next bricks. Until the dense modes
+	 * evaluate them (rvalid), it's the same as lo/hi.
+	 */
+	float vmin, vmax;
+	int rvalid;
+	/* bounds of the field over the same voxels, worked out from the metaballs
+	 * by msurf_begin whenever the brick changes, without evaluating any voxel.
+	 * Bricks all inside (lo > isovalue) or all outside (hi <= isovalue) have
+	 * their cell codes known without touching their voxels.
+	 */
+	float lo, hi;
+	unsigned int valid[MSURF_BRICK_WORDS];		/* voxel values (and analytic gradients) */
+	unsigned int gvalid[MSURF_BRICK_WORDS];		/* finite difference gradients */
+	unsigned int cvalid[MSURF_BRICK_WORDS];		/* cell codes, also cleared by isovalue changes */
+
+	int x, y, z;			/* first voxel */
+	int step[3][2];			/* offsets to the previous and next brick's voxel along
+							   each axis, from the first and last voxel (0: none) */
+	unsigned int cmask;		/* bit n: cells touching sides n have all their corners */
+	int cornoffs[8][8];		/* cell corner offsets, by which far sides it touches */
+	/* neighboring bricks, -1 where there's none. Indexed by the brick offset
+	 * along each axis plus one, as (z * 3 + y) * 3 + x, so nbr[13] is this one.
+	 */
+	int nbr[27];
+	unsigned int used;		/* MSURF_SPARSE: last frame a metaball reached it, 0: free */
+	int next_free;
+};
+
+/* metaball state the cached field was evaluated with */
+struct msurf_ballstate {
+	cgm_vec3 pos;
+	float energy;
+	float rad;				/* support radius, < 0 for infinite */
+	int dirty;
 };
 
 struct msurf_metaball {
@@ -58,32 +111,103 @@ struct msurf_vertex {
 
 struct msurf_volume {
 	unsigned int xres, yres, zres;	/* useful X,Y,Z volume resolution */
-	unsigned int xstore, ystore, xystore;	/* actual storage size (always pow2) */
-	unsigned int xshift, yshift, xyshift;	/* shifts to access rows/slices */
-	unsigned int num_store;		/* total storage count (xstore*ystore*zres) */
+	unsigned int num_store;		/* total storage count (num_bricks * MSURF_BRICK_VOXELS) */
 
 	struct msurf_voxel *voxels;		/* voxels array */
+	unsigned short *qval;			/* half float field values (MSURF_QUANT16) */
+	cgm_vec3 org;					/* position of the first voxel */
 	cgm_vec3 size, rad;				/* size and half-size (radius) of volume */
 	float dx, dy, dz;				/* step between voxels (cell size) */
+	float *xpos, *ypos, *zpos;		/* voxel coordinates along each axis, from worg */
+	unsigned int max_tab;
 
-	struct msurf_cell *cells;		/* cells array (space between 8 voxels) */
+	/* cells (the space between 8 voxels) are implicit, and addressed like
+	 * the voxel at their first corner
+	 */
+	unsigned char *codes;			/* cached marching cubes code, see msurf_brick */
+
+	struct msurf_brick *bricks;		/* dirty tracking bricks */
+	unsigned int bxres, byres, bzres, num_bricks, max_bricks;
+	unsigned int *visited;			/* cells visited by msurf_genmesh, one bit each */
+	float dirty_eps;				/* ball moves below this don't invalidate the field */
+
+	/* the box of voxels the bricks span, the whole volume unless MSURF_SPARSE.
+	 * xpos/ypos/zpos start at worg.
+	 */
+	int worg[3], wres[3];
+
+	/* MSURF_SPARSE: the volume is unbounded, size / resolution only sets the
+	 * voxel spacing. Bricks are allocated where the metaballs can reach, found
+	 * by coordinates through a hash table, and returned to a free list after
+	 * sparse_keep frames without a metaball around (0: default).
+	 */
+	int *bhash;
+	unsigned int hash_size, num_live;
+	int free_brick;
+	int sparse_keep;
+
+	/* MSURF_AUTOFIT: every frame msurf_begin finds the box the metaballs can
+	 * reach, and moves org and size over it, keeping the resolution. The fit
+	 * has some slack, and is only redone when the metaballs leave it or need
+	 * much less than it (fit_shrink times smaller along an axis, 0: default),
+	 * as each refit recalculates the whole field. With MSURF_FLOOR the box
+	 * also spans the floor surface, and the balls' reach accounts for the
+	 * floor field, but the floor itself is only kept under the metaballs.
+	 * Ignored by MSURF_SPARSE volumes. Clearing the flag leaves the volume
+	 * where it was last fitted.
+	 */
+	float fit_shrink;
 
 	float isoval;					/* isosurface value */
+	float cutoff;					/* ignore ball contributions below this (0: never) */
+	int falloff;					/* falloff kernel (MFIELD_INVSQ, MFIELD_WYVILL ...) */
+	float falloff_rad;				/* radius of compact kernels for unit energy */
 	unsigned int flags;
 
 	struct msurf_vertex *varr;		/* isosurface mesh */
 	unsigned int num_verts, max_verts;
 
+	int num_threads;				/* msurf_genmesh worker threads (0: one) */
+	float dense_ratio;				/* MSURF_AUTODENSE surface/total cells (0: default) */
+	struct msurf_traversal *trav;	/* per-thread traversal state */
+
 	struct msurf_metaball *mballs;		/* metaballs */
 	unsigned int num_mballs;
+	struct mfield field;			/* SoA copy of bstate, updated by msurf_begin */
+	struct msurf_ballstate *bstate;	/* metaball state the cached field corresponds to */
+	unsigned int num_bstate, max_bstate;
 
 	float floor_z, floor_energy;
 
+	/* static field layer: the floor and any non-moving metaballs are baked
+	 * once, and the dynamic metaballs are added on top of it every frame.
+	 */
+	struct msurf_metaball *static_mballs;
+	unsigned int num_static_mballs;
+	float *floor_tab;				/* floor field and its z gradient per slice, after zpos */
+	float *base;					/* static metaball field per voxel */
+	cgm_vec3 *base_grad;
+	struct mfield sfield;			/* static metaballs, to bake bricks allocated later */
+
+	/* field parameters the cached field corresponds to */
+	int last_falloff;
+	float last_falloff_rad, last_cutoff, last_isoval;
+	float last_floor_z, last_floor_energy;
+	unsigned int last_fflags;
+
 	int cur;
 };
 
+/* storage address: the brick, then the voxel within the brick. Storage is
+ * only padded to whole bricks (65^3 is stored as 72^3, 100^3 as 104^3), and
+ * the multiplies cost the same as per-axis offset tables would. Not for
+ * MSURF_SPARSE volumes, where bricks are wherever they were allocated.
+ */
 #define msurf_addr(ms, x, y, z) \
-	(((z) << (ms)->xyshift) + ((y) << (ms)->xshift) + (x))
+	((int)((((z) >> MSURF_BRICK_SHIFT) * (ms)->byres + ((y) >> MSURF_BRICK_SHIFT)) * \
+		(ms)->bxres + ((x) >> MSURF_BRICK_SHIFT)) * MSURF_BRICK_VOXELS + \
+	 ((x) & MSURF_BRICK_MASK) + (((y) & MSURF_BRICK_MASK) << MSURF_BRICK_SHIFT) + \
+	 (((z) & MSURF_BRICK_MASK) << (MSURF_BRICK_SHIFT * 2)))
 
 
 int msurf_init(struct msurf_volume *vol);
@@ -92,28 +216,48 @@ void msurf_destroy(struct msurf_volume *vol);
 void msurf_resolution(struct msurf_volume *vol, int x, int y, int z);
 void msurf_size(struct msurf_volume *vol, float x, float y, float z);
 int msurf_metaballs(struct msurf_volume *vol, int count);
+/* static metaballs are baked into the base field. After modifying them, clear
+ * MSURF_STATICVALID to have it recalculated.
+ */
+int msurf_static_metaballs(struct msurf_volume *vol, int count);
 
 int msurf_begin(struct msurf_volume *vol);
-int msurf_proc_cell(struct msurf_volume *vol, struct msurf_cell *cell);
+int msurf_proc_cell(struct msurf_volume *vol, int x, int y, int z);
 void msurf_genmesh(struct msurf_volume *vol);
+/* appends the surface at another isovalue to varr, from the field cached by
+ * msurf_begin/msurf_genmesh, without evaluating the metaballs again. Bricks
+ * which can't contain the isovalue are skipped. The first call after the
+ * field changed evaluates any voxels the traversal didn't reach.
+ */
+void msurf_extract(struct msurf_volume *vol, float isoval);
 
+/* clamped to the volume, except for MSURF_SPARSE volumes which don't end */
 static INLINE void msurf_pos_to_cell(struct msurf_volume *vol, cgm_vec3 pos,
 		int *cx, int *cy, int *cz)
 {
-	int x = (float)(pos.x * vol->xres / vol->size.x);
-	int y = (float)(pos.y * vol->yres / vol->size.y);
-	int z = (float)(pos.z * vol->zres / vol->size.z);
-	*cx = x < 0 ? 0 : (x >= vol->xres ? vol->xres - 1 : x);
-	*cy = y < 0 ? 0 : (y >= vol->yres ? vol->yres - 1 : y);
-	*cz = z < 0 ? 0 : (z >= vol->zres ? vol->zres - 1 : z);
+	int x, y, z;
+
+	cgm_vsub(&pos, &vol->org);
+	if(vol->flags & MSURF_SPARSE) {
+		*cx = (int)floor(pos.x * vol->xres / vol->size.x);
+		*cy = (int)floor(pos.y * vol->yres / vol->size.y);
+		*cz = (int)floor(pos.z * vol->zres / vol->size.z);
+		return;
+	}
+	x = (float)(pos.x * vol->xres / vol->size.x);
+	y = (float)(pos.y * vol->yres / vol->size.y);
+	z = (float)(pos.z * vol->zres / vol->size.z);
+	*cx = x < 0 ? 0 : (x >= (int)vol->xres ? (int)vol->xres - 1 : x);
+	*cy = y < 0 ? 0 : (y >= (int)vol->yres ? (int)vol->yres - 1 : y);
+	*cz = z < 0 ? 0 : (z >= (int)vol->zres ? (int)vol->zres - 1 : z);
 }
 
 static INLINE void msurf_cell_to_pos(struct msurf_volume *vol, int cx, int cy,
 		int cz, cgm_vec3 *pos)
 {
-	pos->x = (float)cx * vol->size.x / (float)vol->xres;
-	pos->y = (float)cy * vol->size.y / (float)vol->yres;
-	pos->z = (float)cz * vol->size.z / (float)vol->zres;
+	pos->x = vol->org.x + (float)cx * vol->size.x / (float)vol->xres;
+	pos->y = vol->org.y + (float)cy * vol->size.y / (float)vol->yres;
+	pos->z = vol->org.z + (float)cz * vol->size.z / (float)vol->zres;
 }
 
 #endif	/* MSURF2_H_ */
@@ -0,0 +1,199 @@
+/*
+shapeblobs - 3D metaballs in a shaped window
+Copyright (C) 2016-2026  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* checks the SIMD field evaluators against the scalar reference ones, and
+ * times both. Exits with a non-zero status on any mismatch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "mfield.h"
+#include "timer.h"
+
+#define NUM_BALLS	16
+#define NUM_TRIALS	2000
+#define MAX_BATCH	8
+#define GRID_RES	16
+
+/* relative tolerance, against the larger of the two values and 1 */
+#define TOLERANCE	1e-4f
+
+#define BENCH_POINTS	4096
+#define BENCH_ITER		200
+
+static const char *kname[] = {"invsq", "wyvill", "nishimura", "blinn"};
+
+static float frand(float lo, float hi)
+{
+	return lo + (hi - lo) * (float)rand() / (float)RAND_MAX;
+}
+
+static void init_balls(struct mfield *mf, int kernel)
+{
+	int i;
+
+	for(i=0; i<mf->num; i++) {
+		mf->x[i] = frand(-1, 1);
+		mf->y[i] = frand(-1, 1);
+		mf->z[i] = frand(-1, 1);
+		mf->energy[i] = frand(0.2f, 1.5f);
+	}
+	mfield_kernel(mf, kernel, 0.75f, kernel == MFIELD_INVSQ ? 0.0f : 1e-3f);
+}
+
+static int compare(const char *what, int kernel, int n, const float *a,
+		const float *b, int count)
+{
+	int i;
+	float mag, err;
+
+	for(i=0; i<count; i++) {
+		mag = fabs(a[i]) > fabs(b[i]) ? fabs(a[i]) : fabs(b[i]);
+		if(mag < 1.0f) mag = 1.0f;
+		err = fabs(a[i] - b[i]);
+		if(!(err <= mag * TOLERANCE)) {
+			fprintf(stderr, "%s (%s, n=%d): element %d: %g != %g\n", what,
+					kname[kernel], n, i, a[i], b[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* mfield_eval against mfield_eval_scalar, at random points */
+static int test_eval(struct mfield *mf, int kernel)
+{
+	int i, j, n, fail = 0;
+	float px[MAX_BATCH], py[MAX_BATCH], pz[MAX_BATCH];
+	float res[2][MAX_BATCH], grad[2][MAX_BATCH * 3];
+
+	for(i=0; i<NUM_TRIALS; i++) {
+		n = i % MAX_BATCH + 1;
+		for(j=0; j<n; j++) {
+			px[j] = frand(-1.5f, 1.5f);
+			py[j] = frand(-1.5f, 1.5f);
+			pz[j] = frand(-1.5f, 1.5f);
+			res[0][j] = res[1][j] = 0.5f;
+		}
+		for(j=0; j<n*3; j++) {
+			grad[0][j] = grad[1][j] = 0.25f;
+		}
+
+		if(i & MAX_BATCH) {
+			mfield_eval(mf, px, py, pz, res[0], grad[0], n);
+			mfield_eval_scalar(mf, px, py, pz, res[1], grad[1], n);
+			fail |= compare("eval grad", kernel, n, grad[0], grad[1], n * 3);
+		} else {
+			mfield_eval(mf, px, py, pz, res[0], 0, n);
+			mfield_eval_scalar(mf, px, py, pz, res[1], 0, n);
+		}
+		fail |= compare("eval", kernel, n, res[0], res[1], n);
+		if(fail) break;
+	}
+	return fail;
+}
+
+/* mfield_eval_row against mfield_eval_row_scalar, at random grid rows */
+static int test_eval_row(struct mfield *mf, int kernel)
+{
+	int i, j, n, x0, y, z, fail = 0;
+	int res3[3] = {GRID_RES, GRID_RES, GRID_RES};
+	float org[3] = {-1.5f, -1.5f, -1.5f};
+	float step[3], res[2][MAX_BATCH], grad[2][MAX_BATCH * 3];
+
+	step[0] = step[1] = step[2] = 3.0f / (GRID_RES - 1);
+	if(mfield_axis_tables(mf, org, step, res3) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<NUM_TRIALS; i++) {
+		n = i % MAX_BATCH + 1;
+		x0 = rand() % (GRID_RES - n + 1);
+		y = rand() % GRID_RES;
+		z = rand() % GRID_RES;
+		for(j=0; j<n; j++) {
+			res[0][j] = res[1][j] = 0.5f;
+		}
+		for(j=0; j<n*3; j++) {
+			grad[0][j] = grad[1][j] = 0.25f;
+		}
+
+		if(i & MAX_BATCH) {
+			mfield_eval_row(mf, 0, 0, 0, x0, y, z, res[0], grad[0], n);
+			mfield_eval_row_scalar(mf, 0, 0, 0, x0, y, z, res[1], grad[1], n);
+			fail |= compare("eval_row grad", kernel, n, grad[0], grad[1], n * 3);
+		} else {
+			mfield_eval_row(mf, 0, 0, 0, x0, y, z, res[0], 0, n);
+			mfield_eval_row_scalar(mf, 0, 0, 0, x0, y, z, res[1], 0, n);
+		}
+		fail |= compare("eval_row", kernel, n, res[0], res[1], n);
+		if(fail) break;
+	}
+	return fail;
+}
+
+/* nanoseconds per point of mfield_eval or mfield_eval_scalar, with gradients */
+static double bench(struct mfield *mf, int scalar)
+{
+	static float px[BENCH_POINTS], py[BENCH_POINTS], pz[BENCH_POINTS];
+	static float res[BENCH_POINTS], grad[BENCH_POINTS * 3];
+	int i;
+	double t0;
+
+	for(i=0; i<BENCH_POINTS; i++) {
+		px[i] = frand(-1.5f, 1.5f);
+		py[i] = frand(-1.5f, 1.5f);
+		pz[i] = frand(-1.5f, 1.5f);
+	}
+
+	t0 = get_time_sec();
+	for(i=0; i<BENCH_ITER; i++) {
+		if(scalar) {
+			mfield_eval_scalar(mf, px, py, pz, res, grad, BENCH_POINTS);
+		} else {
+			mfield_eval(mf, px, py, pz, res, grad, BENCH_POINTS);
+		}
+	}
+	return (get_time_sec() - t0) * 1e9 / ((double)BENCH_ITER * BENCH_POINTS);
+}
+
+int main(void)
+{
+	int k, fail = 0;
+	struct mfield mf;
+
+	srand(1);
+	mfield_init(&mf);
+	if(mfield_resize(&mf, NUM_BALLS) == -1) {
+		return 1;
+	}
+
+	printf("%d balls, ns/eval with gradients:\n", NUM_BALLS);
+	for(k=0; k<MFIELD_NUM_KERNELS; k++) {
+		init_balls(&mf, k);
+		if(test_eval(&mf, k) || test_eval_row(&mf, k)) {
+			fail = 1;
+			continue;
+		}
+		printf("  %-10s simd %6.2f  scalar %6.2f\n", kname[k], bench(&mf, 0),
+				bench(&mf, 1));
+	}
+
+	mfield_destroy(&mf);
+	printf(fail ? "FAILED\n" : "ok\n");
+	return fail;
+}